@@ -0,0 +1,26 @@
+#-------------------------------------------------
+#
+# Throughput benchmarks of the codec and image paths
+#
+#-------------------------------------------------
+
+QT       += core
+QT       -= gui
+
+CONFIG += c++11 console release
+CONFIG -= app_bundle
+
+TARGET = espbenchmark
+TEMPLATE = app
+
+INCLUDEPATH += ..
+
+SOURCES += main.cpp \
+    ../slipcodec.cpp \
+    ../tools.cpp \
+    ../espfirmwareimage.cpp
+
+HEADERS  += ../slipcodec.h \
+    ../espfirmwareimage.h \
+    ../flasherstub.h \
+    ../tools.h
@@ -0,0 +1,280 @@
+/*
+ * Times the host side hot paths of a flash write over firmware sized
+ * inputs and prints the results as JSON, so runs before and after a
+ * change can be compared by a script.
+ */
+
+#include "slipcodec.h"
+#include "espfirmwareimage.h"
+#include "flasherstub.h"
+#include "tools.h"
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTemporaryDir>
+#include <QTextStream>
+
+#include <algorithm>
+#include <functional>
+
+using namespace ESPFlasher;
+
+// Results are folded in here so the compiler cannot drop the work
+static volatile quint32 g_sink;
+
+// The image format allows 16 segments of at most 64 KB
+#define IMAGE_MAX_SEGMENTS  16
+#define IMAGE_SEGMENT_SIZE  0x10000
+
+#define BENCHMARK_ROUNDS    5
+
+struct Input
+{
+    QByteArray data;
+    QByteArray encoded;
+    QString imageFile;
+    int imageSize;
+};
+
+// Firmware-like content: code-like random runs, zero fill and repeated
+// strings, with SLIP delimiters at their natural rate
+static QByteArray makeFirmware(int size, quint32 seed)
+{
+    QByteArray data(size, '\0');
+    quint32 state = seed;
+    char *out = data.data();
+
+    for(int pos = 0; pos < size; pos += 256){
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        int run = qMin(256, size - pos);
+        switch(state % 4){
+        case 0:
+            memset(out + pos, 0, run);
+            break;
+        case 1:
+            for(int i = 0; i < run; i++){
+                out[pos + i] = "ESP8266 firmware"[i % 16];
+            }
+            break;
+        default:
+            for(int i = 0; i < run; i++){
+                state ^= state << 13;
+                state ^= state >> 17;
+                state ^= state << 5;
+                out[pos + i] = char(state);
+            }
+            break;
+        }
+    }
+
+    return data;
+}
+
+// FLASH_DATA frames exactly as ESPRom puts them on the wire
+static void encodeBlocks(SlipEncoder &encoder, const QByteArray &data, int blockSize, QByteArray *stream)
+{
+    quint32 seq = 0;
+    for(int pos = 0; pos < data.size(); pos += blockSize, seq++){
+        int size = qMin(blockSize, data.size() - pos);
+        char header[24];
+        header[0] = '\0';
+        header[1] = 0x03;
+        quint16toBytes(16 + size, &header[2]);
+        quint32toBytes(Tools::checksum(data.mid(pos, size)), &header[4]);
+        quint32toBytes(size, &header[8]);
+        quint32toBytes(seq, &header[12]);
+        quint32toBytes(0, &header[16]);
+        quint32toBytes(0, &header[20]);
+
+        encoder.begin();
+        encoder.append(header, 24);
+        encoder.append(data.constData() + pos, size);
+        encoder.end();
+
+        if(stream){
+            stream->append(encoder.constData(), encoder.size());
+        } else {
+            g_sink = g_sink + encoder.size();
+        }
+    }
+}
+
+// Block preparation of ESPSession::writeRange: slice, pad and checksum
+static void sliceBlocks(const QByteArray &data, int blockSize)
+{
+    for(int pos = 0; pos < data.size(); pos += blockSize){
+        QByteArray block = data.mid(pos, blockSize);
+        int dataSize = block.size();
+        for(int j = 0; j < (blockSize - dataSize); j++){
+            block.append("\xff", 1);
+        }
+        g_sink = g_sink + Tools::checksum(block);
+    }
+}
+
+static QJsonObject measure(const QString &name, qint64 bytes, qint64 minTime, const std::function<void ()> &op)
+{
+    // Warm up caches and let the allocator settle
+    op();
+
+    QList<double> rounds;
+    qint64 iterations = 0;
+
+    for(int round = 0; round < BENCHMARK_ROUNDS; round++){
+        QElapsedTimer timer;
+        qint64 count = 0;
+        timer.start();
+        do {
+            op();
+            count++;
+        } while(timer.nsecsElapsed() < minTime * 1000000 / BENCHMARK_ROUNDS);
+        rounds.append(double(timer.nsecsElapsed()) / count);
+        iterations += count;
+    }
+
+    std::sort(rounds.begin(), rounds.end());
+    double median = rounds.at(BENCHMARK_ROUNDS / 2);
+
+    QJsonObject result;
+    result["name"] = name;
+    result["bytes"] = bytes;
+    result["iterations"] = iterations;
+    result["ns_per_op"] = median;
+    result["ns_per_op_min"] = rounds.first();
+    result["mb_per_s"] = bytes / (median / 1e9) / (1024 * 1024);
+
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    a.setApplicationName("espbenchmark");
+    a.setApplicationVersion("0.1");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Benchmarks checksum, SLIP and firmware image paths.");
+    parser.addHelpOption();
+    parser.addVersionOption();
+
+    QCommandLineOption sizesOption(QStringList() << "s" << "sizes", "Comma separated input sizes in MB.", "mb", "1,2,4");
+    QCommandLineOption timeOption(QStringList() << "t" << "min-time", "Time spent on each benchmark.", "ms", "500");
+    QCommandLineOption filterOption(QStringList() << "f" << "filter", "Only run benchmarks whose name contains this.", "text");
+    QCommandLineOption outputOption(QStringList() << "o" << "output", "Write the JSON report to a file.", "file");
+
+    parser.addOption(sizesOption);
+    parser.addOption(timeOption);
+    parser.addOption(filterOption);
+    parser.addOption(outputOption);
+
+    parser.process(a);
+
+    qint64 minTime = parser.value(timeOption).toLongLong();
+    QString filter = parser.value(filterOption);
+
+    QTemporaryDir tempDir;
+    if(!tempDir.isValid()){
+        QTextStream(stderr) << "Could not create a temporary directory" << "\n";
+        return 1;
+    }
+
+    QJsonArray results;
+    SlipEncoder encoder;
+
+    foreach(const QString &mb, parser.value(sizesOption).split(',')){
+        int size = mb.toDouble() * 1024 * 1024;
+        if(size <= 0){
+            continue;
+        }
+
+        Input input;
+        input.data = makeFirmware(size, size);
+        encodeBlocks(encoder, input.data, ESP_FLASH_BLOCK, &input.encoded);
+
+        // Images beyond the format limit are cut to 16 full segments
+        ESPFirmwareImage image;
+        image.setEntryPoint(0x40100000);
+        for(int i = 0; i < IMAGE_MAX_SEGMENTS && i * IMAGE_SEGMENT_SIZE < size; i++){
+            image.addSegment(0x40100000 + i * IMAGE_SEGMENT_SIZE, input.data.mid(i * IMAGE_SEGMENT_SIZE, IMAGE_SEGMENT_SIZE));
+        }
+        input.imageFile = tempDir.path() + QString("/image-%1.bin").arg(size);
+        image.save(input.imageFile);
+        input.imageSize = QFile(input.imageFile).size();
+
+        auto run = [&](const QString &name, qint64 bytes, const std::function<void ()> &op){
+            if(filter.isEmpty() || name.contains(filter)){
+                QJsonObject result = measure(name, bytes, minTime, op);
+                result["input_bytes"] = size;
+                results.append(result);
+                QTextStream(stderr) << QString("%1 %2 MB: %3 MB/s").arg(name, -24).arg(mb)
+                                       .arg(result["mb_per_s"].toDouble(), 0, 'f', 1) << "\n";
+            }
+        };
+
+        run("checksum", size, [&]{
+            g_sink = g_sink + Tools::checksum(input.data);
+        });
+
+        run("slip_encode", size, [&]{
+            encodeBlocks(encoder, input.data, ESP_FLASH_BLOCK, 0);
+        });
+
+        run("slip_decode", input.encoded.size(), [&]{
+            // Fed in chunks the size of a typical serial read
+            SlipDecoder decoder;
+            for(int pos = 0; pos < input.encoded.size(); pos += 4096){
+                decoder.feed(input.encoded.constData() + pos, qMin(4096, input.encoded.size() - pos));
+                while(decoder.hasFrame()){
+                    g_sink = g_sink + decoder.takeFrame().size();
+                }
+            }
+        });
+
+        run("block_slicing_rom", size, [&]{
+            sliceBlocks(input.data, ESP_FLASH_BLOCK);
+        });
+
+        run("block_slicing_stub", size, [&]{
+            sliceBlocks(input.data, ESP_STUB_FLASH_BLOCK);
+        });
+
+        run("image_parse", input.imageSize, [&]{
+            ESPFirmwareImage parsed(input.imageFile);
+            g_sink = g_sink + parsed.checksum();
+        });
+
+        QString saveFile = tempDir.path() + "/save.bin";
+        run("image_save", input.imageSize, [&]{
+            g_sink = g_sink + image.save(saveFile);
+        });
+    }
+
+    QJsonObject report;
+    report["timestamp"] = QDateTime::currentDateTimeUtc().toString(Qt::ISODate);
+    report["qt_version"] = QString(qVersion());
+    report["checksum_impl"] = QString(Tools::checksumImplementation());
+    report["min_time_ms"] = minTime;
+    report["results"] = results;
+
+    QByteArray json = QJsonDocument(report).toJson();
+
+    if(parser.isSet(outputOption)){
+        QFile file(parser.value(outputOption));
+        if(!file.open(QIODevice::WriteOnly) || file.write(json) != json.size()){
+            QTextStream(stderr) << "Could not write " << file.fileName() << "\n";
+            return 1;
+        }
+    } else {
+        QTextStream(stdout) << json;
+    }
+
+    return 0;
+}
@@ -0,0 +1,372 @@
+#include "commandlineengine.h"
+#include "espsession.h"
+#include "esprom.h"
+#include "espfirmwareimage.h"
+#include "elffile.h"
+#include "flashjob.h"
+#include "tools.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSettings>
+
+#include <stdio.h>
+#if defined (Q_OS_WIN)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace ESPFlasher {
+
+CommandLineOptions::CommandLineOptions() :
+    baudRate(ESP_ROM_BAUD),
+    baudRateSet(false),
+    resetMode(ESPRom::Auto),
+    flashMode(ESPSession::QIO),
+    flashSizeFreq(0),
+    compress(true),
+    diff(false),
+    entryPoint(0),
+    serial(-1)
+{
+}
+
+CommandLineEngine::CommandLineEngine(const CommandLineOptions &options, QObject *parent) :
+    QObject(parent),
+    m_options(options),
+    m_session(new ESPSession(this)),
+    m_ok(false),
+    m_lineOpen(false),
+    m_terminal(isTerminal())
+{
+    connect(m_session, SIGNAL(logMessage(QString,int,int)), this, SLOT(sessionLog(QString,int,int)));
+    connect(m_session, SIGNAL(error(QString)), this, SLOT(sessionError(QString)));
+    connect(m_session, SIGNAL(opened(bool,QString,QString)), this, SLOT(sessionOpened(bool,QString)));
+    connect(m_session, SIGNAL(finished(bool)), this, SLOT(sessionFinished(bool)));
+}
+
+bool CommandLineEngine::isTerminal()
+{
+#if defined (Q_OS_WIN)
+    return _isatty(_fileno(stdout));
+#else
+    return isatty(fileno(stdout));
+#endif
+}
+
+QStringList CommandLineEngine::commands()
+{
+    return QStringList() << "load-ram" << "dump-mem" << "read-mem" << "write-mem" << "write-flash"
+                         << "run" << "image-info" << "make-image" << "elf2image" << "read-mac"
+                         << "flash-id" << "read-flash" << "erase-flash" << "erase-region" << "flash-job";
+}
+
+int CommandLineEngine::run(const QString &command, const QStringList &arguments)
+{
+    int ret;
+    if(command == "image-info"){
+        ret = imageInfo(arguments);
+    } else if(command == "make-image"){
+        ret = makeImage(arguments);
+    } else if(command == "elf2image"){
+        ret = elf2Image(arguments);
+    } else if(command == "flash-job"){
+        ret = flashJob(arguments);
+    } else if(isCommand(command)){
+        ret = runDevice(command, arguments);
+    } else {
+        ret = usage(QString("Unknown command '%1'").arg(command));
+    }
+
+    endLine();
+    return ret;
+}
+
+int CommandLineEngine::runDevice(const QString &command, const QStringList &arguments)
+{
+    quint32 address = 0, size = 0, value = 0, mask = 0xffffffff;
+    QList<FlashFile> files;
+
+    // Arguments are checked before the device gets reset
+    if(command == "load-ram"){
+        if(arguments.size() != 1)
+            return usage("load-ram <image>");
+    } else if(command == "dump-mem" || command == "read-flash"){
+        if(arguments.size() != 3 || !parseNumber(arguments.at(0), &address) || !parseNumber(arguments.at(1), &size))
+            return usage(command + " <address> <size> <file>");
+    } else if(command == "read-mem"){
+        if(arguments.size() != 1 || !parseNumber(arguments.at(0), &address))
+            return usage("read-mem <address>");
+    } else if(command == "write-mem"){
+        if(arguments.size() < 2 || arguments.size() > 3 || !parseNumber(arguments.at(0), &address)
+                || !parseNumber(arguments.at(1), &value) || (arguments.size() == 3 && !parseNumber(arguments.at(2), &mask)))
+            return usage("write-mem <address> <value> [<mask>]");
+    } else if(command == "write-flash"){
+        for(int i = 0; i + 1 < arguments.size(); i += 2){
+            FlashFile file;
+            file.index = files.size();
+            file.filename = arguments.at(i + 1);
+            if(!parseNumber(arguments.at(i), &file.offset) || !QFileInfo(file.filename).isFile())
+                return usage(QString("write-flash: bad address or file '%1 %2'").arg(arguments.at(i)).arg(file.filename));
+            files.append(file);
+        }
+        if(files.isEmpty() || arguments.size() % 2)
+            return usage("write-flash <address> <file> [<address> <file>...]");
+    } else if(command == "erase-region"){
+        if(arguments.size() != 2 || !parseNumber(arguments.at(0), &address) || !parseNumber(arguments.at(1), &size))
+            return usage("erase-region <address> <size>");
+    } else if(!arguments.isEmpty()){
+        return usage(command + " takes no argument");
+    }
+
+    if(m_options.portName.isEmpty()){
+        return usage("No serial port given (--port)");
+    }
+
+    m_session->open(m_options.portName, m_options.baudRate, m_options.resetMode);
+    if(!m_ok){
+        return 1;
+    }
+
+    m_ok = false;
+    if(command == "load-ram"){
+        m_session->loadRam(arguments.at(0));
+    } else if(command == "dump-mem"){
+        m_session->dumpMemory(arguments.at(2), address, size);
+    } else if(command == "read-mem"){
+        m_session->readMemory(address);
+    } else if(command == "write-mem"){
+        m_session->writeMemory(address, value, mask);
+    } else if(command == "write-flash"){
+        QSettings settings;
+        m_session->writeFlash(files, m_options.flashMode, m_options.flashSizeFreq,
+                              settings.value("flashWindow", 1).toInt(), m_options.compress, m_options.diff);
+    } else if(command == "run"){
+        m_session->run();
+    } else if(command == "read-mac"){
+        QString mac = m_session->rom()->macAddress();
+        m_ok = !mac.isEmpty();
+        if(m_ok)
+            print(QString("MAC: %1").arg(mac));
+        else
+            print("Could not read the MAC address", true);
+    } else if(command == "flash-id"){
+        print(QString("Manufacturer: %1").arg(m_session->rom()->deviceManufacturer()));
+        print(QString("Device: %1").arg(m_session->rom()->deviceID()));
+        m_ok = true;
+    } else if(command == "read-flash"){
+        m_session->readFlash(arguments.at(2), address, size);
+    } else if(command == "erase-flash"){
+        m_session->eraseFlash();
+    } else if(command == "erase-region"){
+        m_session->eraseRegion(address, size);
+    }
+
+    bool ok = m_ok;
+    m_session->close();
+
+    return ok ? 0 : 1;
+}
+
+int CommandLineEngine::flashJob(const QStringList &arguments)
+{
+    if(arguments.size() != 1){
+        return usage("flash-job <manifest>");
+    }
+
+    FlashJob job;
+    if(!job.load(arguments.at(0))){
+        print(job.errorText(), true);
+        return 1;
+    }
+
+    if(m_options.portName.isEmpty()){
+        return usage("No serial port given (--port)");
+    }
+
+    // Serial numbers are handed out per job, only used ones are consumed
+    QSettings settings;
+    QString serialKey = QString("jobSerials/%1").arg(job.name().isEmpty() ? QFileInfo(arguments.at(0)).baseName() : job.name());
+    quint32 serial = m_options.serial >= 0 ? m_options.serial : settings.value(serialKey, job.serialStart()).toUInt();
+
+    qint32 baudRate = (m_options.baudRateSet || !job.baudRate()) ? m_options.baudRate : job.baudRate();
+    m_session->open(m_options.portName, baudRate, m_options.resetMode);
+    if(!m_ok){
+        return 1;
+    }
+
+    m_ok = false;
+    m_session->writeJob(job, serial, settings.value("flashWindow", 1).toInt());
+    bool ok = m_ok;
+    m_session->close();
+
+    if(ok && job.usesSerial()){
+        settings.setValue(serialKey, serial + 1);
+    }
+
+    return ok ? 0 : 1;
+}
+
+int CommandLineEngine::imageInfo(const QStringList &arguments)
+{
+    if(arguments.size() != 1){
+        return usage("image-info <image>");
+    }
+
+    ESPFirmwareImage image(arguments.at(0));
+    if(!image.isValid()){
+        print(image.errorText(), true);
+        return 1;
+    }
+
+    print(image.entryPoint() != 0 ? QString::asprintf("Entry point: 0x%08x", image.entryPoint())
+                                  : QString("Entry point: not set"));
+    print(QString("%1 segments").arg(image.segments().size()));
+
+    quint8 checksum = ESP_CHECKSUM_MAGIC;
+    for(int i = 0; i < image.segments().size(); i++){
+        const Segment &segment = image.segments().at(i);
+        print(QString::asprintf("Segment %d: %d bytes at 0x%08x", i + 1, segment.size, segment.offset));
+        checksum = Tools::checksum(segment.data, checksum);
+    }
+
+    bool valid = image.checksum() == checksum;
+    print(QString::asprintf("Checksum: 0x%02x (%s)", image.checksum(), valid ? "valid" : "invalid"));
+
+    return valid ? 0 : 1;
+}
+
+int CommandLineEngine::makeImage(const QStringList &arguments)
+{
+    if(arguments.size() < 3 || arguments.size() % 2 == 0){
+        return usage("make-image <output> <address> <file> [<address> <file>...]");
+    }
+
+    ESPFirmwareImage image;
+    for(int i = 1; i + 1 < arguments.size(); i += 2){
+        quint32 address;
+        if(!parseNumber(arguments.at(i), &address)){
+            return usage(QString("Bad address '%1'").arg(arguments.at(i)));
+        }
+
+        QFile file(arguments.at(i + 1));
+        if(!file.open(QIODevice::ReadOnly)){
+            print(QString("%1: %2").arg(file.fileName()).arg(file.errorString()), true);
+            return 1;
+        }
+        QByteArray data = file.readAll();
+        image.addSegment(address, data);
+        print(QString("Segment %1 bytes at 0x%2").arg(data.size()).arg(address, 1, 16));
+    }
+
+    image.setEntryPoint(m_options.entryPoint);
+    image.setFlashMode(m_options.flashMode);
+    image.setFlashSizeFreq(m_options.flashSizeFreq);
+    if(!image.save(arguments.at(0))){
+        print(QString("Could not write %1").arg(arguments.at(0)), true);
+        return 1;
+    }
+
+    ESPFirmwareImage check(arguments.at(0));
+    if(!check.isValid()){
+        print(check.errorText(), true);
+        return 1;
+    }
+
+    return 0;
+}
+
+int CommandLineEngine::elf2Image(const QStringList &arguments)
+{
+    if(arguments.size() != 1){
+        return usage("elf2image <elf> [--output <dir>]");
+    }
+
+    QString elfFilename = arguments.at(0);
+    QString imagePath = m_options.outputPath.isEmpty() ? QFileInfo(elfFilename).absolutePath() : m_options.outputPath;
+
+    QSettings settings;
+    bool useSysPath = settings.value("useSystemPATH", true).toBool();
+    QString tcPath = useSysPath ? "" : settings.value("tcPath").toString();
+
+    ELFFile elfFile(elfFilename, tcPath);
+    connect(&elfFile, SIGNAL(elfError(QString)), this, SLOT(sessionError(QString)));
+    connect(&elfFile, SIGNAL(message(QString)), this, SLOT(elfMessage(QString)));
+
+    return elfFile.saveImages(imagePath, m_options.flashMode, m_options.flashSizeFreq) ? 0 : 1;
+}
+
+bool CommandLineEngine::parseNumber(const QString &text, quint32 *value)
+{
+    bool ok;
+    *value = text.toUInt(&ok, 0);
+    return ok;
+}
+
+int CommandLineEngine::usage(const QString &text)
+{
+    print(text, true);
+    return 2;
+}
+
+void CommandLineEngine::print(const QString &text, bool error, bool replace)
+{
+    QByteArray line = text.toLocal8Bit();
+
+    // A terminal keeps the last line open, so progress can overwrite it like the GUI log
+    if(m_terminal && !error){
+        fputs(replace ? "\r\033[K" : (m_lineOpen ? "\n" : ""), stdout);
+        fputs(line.constData(), stdout);
+        fflush(stdout);
+        m_lineOpen = true;
+        return;
+    }
+
+    endLine();
+    line += "\n";
+    fputs(line.constData(), error ? stderr : stdout);
+    fflush(stdout);
+}
+
+void CommandLineEngine::endLine()
+{
+    if(m_lineOpen){
+        fputs("\n", stdout);
+        fflush(stdout);
+        m_lineOpen = false;
+    }
+}
+
+void CommandLineEngine::sessionLog(const QString &text, int level, int row)
+{
+    print(text, level == ESPSession::Error, row > 0);
+}
+
+void CommandLineEngine::elfMessage(const QString &text)
+{
+    print(text);
+}
+
+void CommandLineEngine::sessionError(const QString &errorText)
+{
+    print(errorText, true);
+}
+
+void CommandLineEngine::sessionOpened(bool ok, const QString &macAddress)
+{
+    m_ok = ok;
+    if(ok){
+        print(QString("Connected to %1 (%2)").arg(m_options.portName).arg(macAddress));
+    } else {
+        print(QString("Failed to connect to ESP8266 on %1").arg(m_options.portName), true);
+    }
+}
+
+void CommandLineEngine::sessionFinished(bool ok)
+{
+    m_ok = ok;
+}
+
+} //namespace ESPFlasher
@@ -0,0 +1,75 @@
+#ifndef COMMANDLINEENGINE_H
+#define COMMANDLINEENGINE_H
+
+#include <QObject>
+#include <QStringList>
+
+namespace ESPFlasher {
+
+class ESPSession;
+
+struct CommandLineOptions
+{
+    CommandLineOptions();
+
+    QString portName;
+    qint32 baudRate;
+    bool baudRateSet;   // otherwise a flash job may pick the rate
+    int resetMode;
+    int flashMode;
+    int flashSizeFreq;
+    bool compress;
+    bool diff;
+    quint32 entryPoint;
+    QString outputPath;
+    qint64 serial;      // device serial of flash-job, -1 for the next stored one
+};
+
+/*
+ * Runs the positional commands of the command line without any widget:
+ * device commands go through an ESPSession on the calling thread, image
+ * commands work on files only. Meant for QCoreApplication and scripts.
+ */
+class CommandLineEngine : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CommandLineEngine(const CommandLineOptions &options, QObject *parent = 0);
+
+    static QStringList commands();
+    static bool isCommand(const QString &name) { return commands().contains(name); }
+
+    // Returns the process exit code: 0 on success, 1 on failure, 2 on usage errors
+    int run(const QString &command, const QStringList &arguments);
+
+private slots:
+    void sessionLog(const QString &text, int level, int row);
+    void sessionError(const QString &errorText);
+    void sessionOpened(bool ok, const QString &macAddress);
+    void sessionFinished(bool ok);
+    void elfMessage(const QString &text);
+
+private:
+    int runDevice(const QString &command, const QStringList &arguments);
+    int flashJob(const QStringList &arguments);
+    int imageInfo(const QStringList &arguments);
+    int makeImage(const QStringList &arguments);
+    int elf2Image(const QStringList &arguments);
+
+    static bool isTerminal();
+    bool parseNumber(const QString &text, quint32 *value);
+    int usage(const QString &text);
+    void print(const QString &text, bool error = false, bool replace = false);
+    void endLine();
+
+private:
+    CommandLineOptions m_options;
+    ESPSession *m_session;
+    bool m_ok;
+    bool m_lineOpen;
+    bool m_terminal;
+};
+
+} //namespace ESPFlasher
+
+#endif // COMMANDLINEENGINE_H
@@ -0,0 +1,240 @@
+#include "commandstats.h"
+#include "protocoltrace.h"
+
+#include <QJsonArray>
+
+namespace ESPFlasher {
+
+LatencyHistogram::LatencyHistogram() :
+    m_count(0),
+    m_sum(0),
+    m_min(0),
+    m_max(0)
+{
+    for(int i = 0; i < ESP_LATENCY_BUCKETS; i++){
+        m_buckets[i] = 0;
+    }
+}
+
+void LatencyHistogram::add(qint64 us)
+{
+    us = qMax<qint64>(us, 0);
+
+    // Bucket i holds [2^i, 2^(i+1)) us, the first one everything below 2 us
+    int bucket = 0;
+    while(bucket < ESP_LATENCY_BUCKETS - 1 && (us >> (bucket + 1)) > 0){
+        bucket++;
+    }
+
+    m_buckets[bucket]++;
+    m_min = m_count ? qMin(m_min, us) : us;
+    m_max = qMax(m_max, us);
+    m_sum += us;
+    m_count++;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other)
+{
+    if(!other.m_count){
+        return;
+    }
+
+    for(int i = 0; i < ESP_LATENCY_BUCKETS; i++){
+        m_buckets[i] += other.m_buckets[i];
+    }
+    m_min = m_count ? qMin(m_min, other.m_min) : other.m_min;
+    m_max = qMax(m_max, other.m_max);
+    m_sum += other.m_sum;
+    m_count += other.m_count;
+}
+
+qint64 LatencyHistogram::percentile(double p) const
+{
+    if(!m_count){
+        return 0;
+    }
+
+    double rank = p * m_count;
+    quint64 seen = 0;
+    for(int i = 0; i < ESP_LATENCY_BUCKETS; i++){
+        if(m_buckets[i] && seen + m_buckets[i] >= rank){
+            qint64 low = i ? (qint64(1) << i) : 0;
+            qint64 high = qint64(1) << (i + 1);
+            qint64 value = low + qint64((high - low) * (rank - seen) / m_buckets[i]);
+            return qBound(m_min, value, m_max);
+        }
+        seen += m_buckets[i];
+    }
+
+    return m_max;
+}
+
+QJsonObject LatencyHistogram::toJson() const
+{
+    QJsonObject json;
+    json["count"] = double(m_count);
+    json["min_us"] = min();
+    json["max_us"] = max();
+    json["mean_us"] = mean();
+    json["p50_us"] = percentile(0.5);
+    json["p90_us"] = percentile(0.9);
+    json["p99_us"] = percentile(0.99);
+
+    // Trailing empty buckets are left out
+    int used = ESP_LATENCY_BUCKETS;
+    while(used > 0 && !m_buckets[used - 1]){
+        used--;
+    }
+    QJsonArray buckets;
+    for(int i = 0; i < used; i++){
+        buckets.append(double(m_buckets[i]));
+    }
+    json["log2_buckets"] = buckets;
+
+    return json;
+}
+
+CommandCounters::CommandCounters() :
+    sent(0),
+    completed(0),
+    failed(0),
+    timeouts(0),
+    cancelled(0),
+    retries(0),
+    bytesSent(0),
+    bytesReceived(0)
+{
+}
+
+CommandStats::CommandStats(CommandStats *total) :
+    m_total(total),
+    m_streamFrames(0),
+    m_streamBytes(0)
+{
+    m_timer.start();
+}
+
+void CommandStats::clear()
+{
+    m_commands.clear();
+    m_streamFrames = 0;
+    m_streamBytes = 0;
+    m_timer.start();
+}
+
+void CommandStats::sent(int cmd, int bytes)
+{
+    CommandCounters &counters = m_commands[cmd];
+    counters.sent++;
+    counters.bytesSent += bytes;
+
+    if(m_total){
+        m_total->sent(cmd, bytes);
+    }
+}
+
+void CommandStats::completed(int cmd, qint64 latency, int bytes, bool ok)
+{
+    CommandCounters &counters = m_commands[cmd];
+    counters.bytesReceived += bytes;
+    if(ok){
+        counters.completed++;
+        counters.latency.add(latency);
+    } else {
+        counters.failed++;
+    }
+
+    if(m_total){
+        m_total->completed(cmd, latency, bytes, ok);
+    }
+}
+
+void CommandStats::timedOut(int cmd)
+{
+    m_commands[cmd].timeouts++;
+
+    if(m_total){
+        m_total->timedOut(cmd);
+    }
+}
+
+void CommandStats::cancelled(int cmd)
+{
+    m_commands[cmd].cancelled++;
+
+    if(m_total){
+        m_total->cancelled(cmd);
+    }
+}
+
+void CommandStats::retried(int cmd)
+{
+    m_commands[cmd].retries++;
+
+    if(m_total){
+        m_total->retried(cmd);
+    }
+}
+
+void CommandStats::streamed(int bytes)
+{
+    m_streamFrames++;
+    m_streamBytes += bytes;
+
+    if(m_total){
+        m_total->streamed(bytes);
+    }
+}
+
+quint64 CommandStats::bytesSent() const
+{
+    quint64 bytes = 0;
+    foreach(const CommandCounters &counters, m_commands){
+        bytes += counters.bytesSent;
+    }
+    return bytes;
+}
+
+quint64 CommandStats::bytesReceived() const
+{
+    quint64 bytes = m_streamBytes;
+    foreach(const CommandCounters &counters, m_commands){
+        bytes += counters.bytesReceived;
+    }
+    return bytes;
+}
+
+QJsonObject CommandStats::toJson() const
+{
+    QJsonObject commands;
+    for(QMap<int, CommandCounters>::const_iterator it = m_commands.constBegin(); it != m_commands.constEnd(); ++it){
+        const CommandCounters &counters = it.value();
+        QJsonObject command;
+        command["sent"] = double(counters.sent);
+        command["completed"] = double(counters.completed);
+        command["failed"] = double(counters.failed);
+        command["timeouts"] = double(counters.timeouts);
+        command["cancelled"] = double(counters.cancelled);
+        command["retries"] = double(counters.retries);
+        command["bytes_sent"] = double(counters.bytesSent);
+        command["bytes_received"] = double(counters.bytesReceived);
+        command["latency"] = counters.latency.toJson();
+        commands[TraceReplayer::commandName(it.key())] = command;
+    }
+
+    double seconds = qMax<qint64>(elapsed(), 1) / 1000.0;
+
+    QJsonObject json;
+    json["elapsed_ms"] = elapsed();
+    json["bytes_sent"] = double(bytesSent());
+    json["bytes_received"] = double(bytesReceived());
+    json["tx_bytes_per_s"] = bytesSent() / seconds;
+    json["rx_bytes_per_s"] = bytesReceived() / seconds;
+    json["stream_frames"] = double(m_streamFrames);
+    json["stream_bytes"] = double(m_streamBytes);
+    json["commands"] = commands;
+
+    return json;
+}
+
+} //namespace ESPFlasher
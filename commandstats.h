@@ -0,0 +1,94 @@
+#ifndef COMMANDSTATS_H
+#define COMMANDSTATS_H
+
+#include <QElapsedTimer>
+#include <QJsonObject>
+#include <QList>
+#include <QMap>
+
+namespace ESPFlasher {
+
+// Power of two buckets from 1 us up to about 35 minutes
+#define ESP_LATENCY_BUCKETS     32
+
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    void add(qint64 us);
+    void merge(const LatencyHistogram &other);
+
+    quint64 count() const { return m_count; }
+    qint64 min() const { return m_count ? m_min : 0; }
+    qint64 max() const { return m_max; }
+    double mean() const { return m_count ? double(m_sum) / m_count : 0; }
+
+    // Interpolated within the bucket holding the p-th fraction of samples
+    qint64 percentile(double p) const;
+
+    QJsonObject toJson() const;
+
+private:
+    quint64 m_buckets[ESP_LATENCY_BUCKETS];
+    quint64 m_count;
+    qint64 m_sum;
+    qint64 m_min;
+    qint64 m_max;
+};
+
+struct CommandCounters
+{
+    CommandCounters();
+
+    quint64 sent;
+    quint64 completed;
+    quint64 failed;
+    quint64 timeouts;
+    quint64 cancelled;
+    quint64 retries;
+    quint64 bytesSent;
+    quint64 bytesReceived;
+    LatencyHistogram latency;
+};
+
+/*
+ * Counters and latencies per command, fed by ESPRom as frames go out and
+ * responses come back. Everything recorded is also added to the total the
+ * instance was created with, so one ESPRom keeps both per-port totals and
+ * the statistics of the current operation.
+ */
+class CommandStats
+{
+public:
+    explicit CommandStats(CommandStats *total = 0);
+
+    void clear();
+
+    void sent(int cmd, int bytes);
+    void completed(int cmd, qint64 latency, int bytes, bool ok);
+    void timedOut(int cmd);
+    void cancelled(int cmd);
+    void retried(int cmd);
+    // Raw data frames outside of any command (flash read streams)
+    void streamed(int bytes);
+
+    QList<int> commands() const { return m_commands.keys(); }
+    CommandCounters counters(int cmd) const { return m_commands.value(cmd); }
+    qint64 elapsed() const { return m_timer.elapsed(); }
+    quint64 bytesSent() const;
+    quint64 bytesReceived() const;
+
+    QJsonObject toJson() const;
+
+private:
+    CommandStats *m_total;
+    QMap<int, CommandCounters> m_commands;
+    quint64 m_streamFrames;
+    quint64 m_streamBytes;
+    QElapsedTimer m_timer;
+};
+
+} //namespace ESPFlasher
+
+#endif // COMMANDSTATS_H
@@ -1,5 +1,8 @@
 #include "elffile.h"
+#include "espfirmwareimage.h"
 
+#include <QDir>
+#include <QFile>
 #include <QProcess>
 #include <QDebug>
 #include <QTemporaryFile>
@@ -112,5 +115,51 @@ QByteArray ELFFile::loadSection(const QString  &section)
     return QByteArray();
 }
 
+bool ELFFile::saveImages(const QString &imagePath, quint8 flashMode, quint8 flashSizeFreq)
+{
+    bool ok;
+    quint32 entryPoint = getEntryPoint(&ok);
+    if(!ok)
+        return false;
+
+    ESPFirmwareImage image;
+    image.setEntryPoint(entryPoint);
+    image.setFlashMode(flashMode);
+    image.setFlashSizeFreq(flashSizeFreq);
+
+    QStringList sections = QStringList() << ".text" << ".data" << ".rodata";
+    QStringList starts = QStringList() << "_text_start" << "_data_start" << "_rodata_start";
+    for(int i = 0; i < sections.size(); i++){
+        quint32 address = getSymbolAddr(starts.at(i), &ok);
+        if(!ok)
+            break;
+        QByteArray data = loadSection(sections.at(i));
+        image.addSegment(address, data);
+        emit message(QString("Section %1 (%2 bytes at 0x%3)").arg(sections.at(i)).arg(data.size()).arg(address, 1, 16));
+    }
+
+    if(!image.save(QDir(imagePath).filePath("0x00000.bin"))){
+        emit elfError(QString("Could not write to %1").arg(imagePath));
+        return false;
+    }
+
+    quint32 iromStart = getSymbolAddr("_irom0_text_start", &ok);
+    if(!ok || iromStart < 0x40200000){
+        emit elfError("No _irom0_text_start symbol in the ELF file");
+        return false;
+    }
+
+    QByteArray data = loadSection(".irom0.text");
+    quint32 offset = iromStart - 0x40200000;
+    QFile file(QDir(imagePath).filePath(QString::asprintf("0x%05x.bin", offset)));
+    if(!file.open(QIODevice::WriteOnly) || file.write(data) != data.size()){
+        emit elfError(QString("Could not write %1").arg(file.fileName()));
+        return false;
+    }
+    emit message(QString("Section .irom0.text (%1 bytes at 0x%2)").arg(data.size()).arg(iromStart, 1, 16));
+
+    return true;
+}
+
 } //namespace ESPFlasher
 
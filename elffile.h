@@ -21,8 +21,13 @@ public:
     QByteArray loadSection(const QString &section);
     QMap<QString, quint32> symbols() const {return m_symbols; }
 
+    // Writes the 0x00000.bin boot image and the irom0 image found in the ELF
+    // file to imagePath, reporting each section through message()
+    bool saveImages(const QString &imagePath, quint8 flashMode, quint8 flashSizeFreq);
+
 signals:
     void elfError(const QString &errorText);
+    void message(const QString &text);
 
 private:
     bool fetchSymbols();
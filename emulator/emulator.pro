@@ -0,0 +1,25 @@
+#-------------------------------------------------
+#
+# Virtual ESP8266 ROM bootloader on a pseudo-terminal
+#
+#-------------------------------------------------
+
+QT       += core
+QT       -= gui
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+TARGET = espemulator
+TEMPLATE = app
+
+INCLUDEPATH += ..
+
+SOURCES += main.cpp \
+    romemulator.cpp \
+    ../slipcodec.cpp \
+    ../tools.cpp
+
+HEADERS  += romemulator.h \
+    ../slipcodec.h \
+    ../tools.h
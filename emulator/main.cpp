@@ -0,0 +1,107 @@
+#include "romemulator.h"
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QSocketNotifier>
+#include <QFile>
+#include <QDebug>
+
+#include <signal.h>
+#include <unistd.h>
+
+using namespace ESPFlasher;
+
+static int signalPipe[2];
+
+static void quitHandler(int)
+{
+    char byte = 0;
+    ssize_t ret = ::write(signalPipe[1], &byte, 1);
+    Q_UNUSED(ret);
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    a.setApplicationName("espemulator");
+    a.setApplicationVersion("0.1");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Emulates the ESP8266 ROM bootloader on a pseudo-terminal.");
+    parser.addHelpOption();
+    parser.addVersionOption();
+
+    QCommandLineOption flashOption(QStringList() << "f" << "flash", "Initial flash content.", "file");
+    QCommandLineOption sizeOption(QStringList() << "s" << "flash-size", "Flash size in KB when no file is given.", "kb", "4096");
+    QCommandLineOption dumpOption(QStringList() << "d" << "dump", "Write the flash content to a file on exit.", "file");
+    QCommandLineOption linkOption(QStringList() << "l" << "link", "Symlink pointing at the emulated port.", "path");
+    QCommandLineOption baudOption(QStringList() << "b" << "baud", "Virtual baud rate, 0 for an unpaced link.", "baud", "115200");
+    QCommandLineOption latencyOption("latency", "Delay in ms before each response.", "ms", "0");
+    QCommandLineOption eraseOption("erase-time", "Time in ms to erase one 4 KB sector.", "ms", "20");
+    QCommandLineOption dropOption("drop", "Probability of dropping a response.", "rate", "0");
+    QCommandLineOption corruptOption("corrupt", "Probability of flipping a bit in a response.", "rate", "0");
+    QCommandLineOption seedOption("seed", "Seed for the fault injection.", "seed", "1");
+
+    parser.addOption(flashOption);
+    parser.addOption(sizeOption);
+    parser.addOption(dumpOption);
+    parser.addOption(linkOption);
+    parser.addOption(baudOption);
+    parser.addOption(latencyOption);
+    parser.addOption(eraseOption);
+    parser.addOption(dropOption);
+    parser.addOption(corruptOption);
+    parser.addOption(seedOption);
+
+    parser.process(a);
+
+    RomEmulator emulator;
+    QObject::connect(&emulator, &RomEmulator::message, [](const QString &text){ qInfo().noquote() << text; });
+
+    if(parser.isSet(flashOption)){
+        QFile file(parser.value(flashOption));
+        if(!file.open(QIODevice::ReadOnly)){
+            qCritical().noquote() << "Could not open" << file.fileName();
+            return 1;
+        }
+        emulator.setFlash(file.readAll());
+    } else {
+        emulator.setFlash(QByteArray(parser.value(sizeOption).toInt() * 1024, '\xff'));
+    }
+
+    emulator.setBaudRate(parser.value(baudOption).toInt());
+    emulator.setLatency(parser.value(latencyOption).toInt());
+    emulator.setSectorEraseTime(parser.value(eraseOption).toInt());
+    emulator.setDropRate(parser.value(dropOption).toDouble());
+    emulator.setCorruptRate(parser.value(corruptOption).toDouble());
+    emulator.setSeed(parser.value(seedOption).toUInt());
+
+    if(!emulator.open(parser.value(linkOption))){
+        qCritical().noquote() << emulator.errorText();
+        return 1;
+    }
+
+    qInfo().noquote() << "Emulated ESP8266 on" << emulator.portName();
+
+    // Leave the event loop on SIGINT/SIGTERM so the flash still gets dumped
+    if(::pipe(signalPipe) == 0){
+        signal(SIGINT, quitHandler);
+        signal(SIGTERM, quitHandler);
+        QSocketNotifier *notifier = new QSocketNotifier(signalPipe[0], QSocketNotifier::Read, &a);
+        QObject::connect(notifier, SIGNAL(activated(int)), &a, SLOT(quit()));
+    }
+
+    int ret = a.exec();
+
+    qInfo().noquote() << emulator.statistics();
+
+    if(parser.isSet(dumpOption)){
+        QFile file(parser.value(dumpOption));
+        if(!file.open(QIODevice::WriteOnly) || file.write(emulator.flash()) != emulator.flash().size()){
+            qCritical().noquote() << "Could not write" << file.fileName();
+            return 1;
+        }
+    }
+
+    return ret;
+}
@@ -0,0 +1,437 @@
+#include "romemulator.h"
+#include "tools.h"
+
+#include <QSocketNotifier>
+#include <QTimer>
+#include <QFile>
+
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+namespace ESPFlasher {
+
+// Entry points the host jumps to through MEM_END
+#define ROM_STUB_ADDRESS    0x40100000
+#define ROM_SFLASH_ENTRY    0x4010001c
+#define ROM_CHIP_ERASE      0x40004984
+#define ROM_DIO_UNLOCK      0x40000080
+
+// SPI controller: writing the RDID command latches the JEDEC id into W0
+#define SPI_CMD_REG         0x60000200
+#define SPI_W0_REG          0x60000240
+#define SPI_CMD_RDID        0x10000000
+
+// Winbond W25Q32
+#define EMULATED_FLASH_ID   0x1640ef
+
+RomEmulator::RomEmulator(QObject *parent) :
+    QObject(parent),
+    m_master(-1),
+    m_slave(-1),
+    m_notifier(0),
+    m_timer(new QTimer(this)),
+    m_rxFree(0),
+    m_txFree(0),
+    m_baudRate(ESP_ROM_BAUD),
+    m_latency(0),
+    m_sectorEraseTime(20000),
+    m_syncReplies(8),
+    m_dropRate(0),
+    m_corruptRate(0),
+    m_random(1),
+    m_memOffset(0),
+    m_memBlockSize(0),
+    m_flashOffset(0),
+    m_flashBlockSize(0),
+    m_framesIn(0),
+    m_framesOut(0),
+    m_bytesIn(0),
+    m_bytesOut(0),
+    m_dropped(0),
+    m_corrupted(0)
+{
+    m_timer->setSingleShot(true);
+    m_timer->setTimerType(Qt::PreciseTimer);
+    connect(m_timer, SIGNAL(timeout()), this, SLOT(runEvents()));
+
+    m_regs[ESP_OTP_MAC0] = 0x5a000000;
+    m_regs[ESP_OTP_MAC1] = 0x0000e5f1;
+
+    m_clock.start();
+}
+
+RomEmulator::~RomEmulator()
+{
+    if(!m_linkPath.isEmpty()){
+        QFile::remove(m_linkPath);
+    }
+    if(m_slave >= 0){
+        ::close(m_slave);
+    }
+    if(m_master >= 0){
+        ::close(m_master);
+    }
+}
+
+bool RomEmulator::open(const QString &linkPath)
+{
+    m_master = posix_openpt(O_RDWR | O_NOCTTY);
+    if(m_master < 0 || grantpt(m_master) != 0 || unlockpt(m_master) != 0){
+        m_errorText = "Could not allocate a pseudo-terminal";
+        return false;
+    }
+
+    m_portName = QString::fromLocal8Bit(ptsname(m_master));
+
+    // Holding the slave open keeps the master readable between host sessions
+    m_slave = ::open(ptsname(m_master), O_RDWR | O_NOCTTY);
+    if(m_slave < 0){
+        m_errorText = QString("Could not open %1").arg(m_portName);
+        return false;
+    }
+
+    struct termios tio;
+    if(tcgetattr(m_slave, &tio) == 0){
+        cfmakeraw(&tio);
+        tcsetattr(m_slave, TCSANOW, &tio);
+    }
+
+    if(!linkPath.isEmpty()){
+        QFile::remove(linkPath);
+        if(!QFile::link(m_portName, linkPath)){
+            m_errorText = QString("Could not link %1 to %2").arg(linkPath).arg(m_portName);
+            return false;
+        }
+        m_linkPath = linkPath;
+    }
+
+    m_notifier = new QSocketNotifier(m_master, QSocketNotifier::Read, this);
+    connect(m_notifier, SIGNAL(activated(int)), this, SLOT(readInput()));
+
+    return true;
+}
+
+void RomEmulator::setSeed(quint32 seed)
+{
+    m_random = seed ? seed : 1;
+}
+
+QString RomEmulator::statistics() const
+{
+    return QString("%1 frames (%2 bytes) in, %3 frames (%4 bytes) out, %5 dropped, %6 corrupted, %7 framing errors")
+            .arg(m_framesIn).arg(m_bytesIn).arg(m_framesOut).arg(m_bytesOut)
+            .arg(m_dropped).arg(m_corrupted).arg(m_decoder.errors());
+}
+
+qint64 RomEmulator::wireTime(int bytes) const
+{
+    // 8N1: ten bit times per byte
+    if(m_baudRate <= 0){
+        return 0;
+    }
+    return qint64(bytes) * 10 * 1000000 / m_baudRate;
+}
+
+void RomEmulator::readInput()
+{
+    char buffer[4096];
+    ssize_t size = ::read(m_master, buffer, sizeof(buffer));
+    if(size <= 0){
+        return;
+    }
+
+    m_bytesIn += size;
+    m_decoder.feed(buffer, size);
+
+    // The pty delivers instantly; a frame only counts as received once it
+    // would have come through the wire at the virtual baud rate
+    while(m_decoder.hasFrame()){
+        QByteArray frame = m_decoder.takeFrame();
+        m_rxFree = qMax(now(), m_rxFree) + wireTime(frame.size() + 2);
+        schedule(m_rxFree, true, frame);
+    }
+}
+
+void RomEmulator::schedule(qint64 due, bool incoming, const QByteArray &data)
+{
+    Event event;
+    event.due = due;
+    event.incoming = incoming;
+    event.data = data;
+
+    int i = m_events.size();
+    while(i > 0 && m_events.at(i - 1).due > due){
+        i--;
+    }
+    m_events.insert(i, event);
+
+    if(i == 0){
+        m_timer->start(0);
+    }
+}
+
+void RomEmulator::runEvents()
+{
+    while(!m_events.isEmpty() && m_events.first().due <= now()){
+        Event event = m_events.takeFirst();
+        if(event.incoming){
+            handleFrame(event.data);
+        } else {
+            const char *data = event.data.constData();
+            int left = event.data.size();
+            while(left > 0){
+                ssize_t written = ::write(m_master, data, left);
+                if(written <= 0){
+                    break;
+                }
+                data += written;
+                left -= written;
+            }
+        }
+    }
+
+    if(!m_events.isEmpty()){
+        qint64 wait = m_events.first().due - now();
+        m_timer->start(qMax<qint64>(0, (wait + 999) / 1000));
+    }
+}
+
+bool RomEmulator::chance(double rate)
+{
+    if(rate <= 0){
+        return false;
+    }
+
+    // xorshift32, reproducible for a given seed
+    m_random ^= m_random << 13;
+    m_random ^= m_random >> 17;
+    m_random ^= m_random << 5;
+    return m_random < rate * 4294967296.0;
+}
+
+void RomEmulator::send(const QByteArray &data, qint64 busy)
+{
+    if(chance(m_dropRate)){
+        m_dropped++;
+        return;
+    }
+
+    m_encoder.begin();
+    m_encoder.append(data.constData(), data.size());
+    m_encoder.end();
+    QByteArray wire(m_encoder.constData(), m_encoder.size());
+
+    if(wire.size() > 2 && chance(m_corruptRate)){
+        int index = 1 + m_random % (wire.size() - 2);
+        wire[index] = wire.at(index) ^ (1 << (m_random % 8));
+        m_corrupted++;
+    }
+
+    qint64 due = qMax(now() + m_latency + busy, m_txFree);
+    m_txFree = due + wireTime(wire.size());
+    m_framesOut++;
+    m_bytesOut += wire.size();
+
+    // Handed to the pty once its last byte would be on the wire
+    schedule(m_txFree, false, wire);
+}
+
+void RomEmulator::reply(quint8 cmd, quint32 value, Status status, qint64 busy)
+{
+    char bytes[10];
+    bytes[0] = 0x01;
+    bytes[1] = cmd;
+    quint16toBytes(2, &bytes[2]);
+    quint32toBytes(value, &bytes[4]);
+    bytes[8] = status == StatusOK ? 0 : 1;
+    bytes[9] = status;
+
+    send(QByteArray(bytes, 10), busy);
+}
+
+void RomEmulator::handleFrame(const QByteArray &frame)
+{
+    m_framesIn++;
+
+    // Malformed requests are dropped, like the ROM does
+    if(frame.size() < 8 || frame.at(0) != 0x00){
+        return;
+    }
+
+    quint8 cmd = frame.at(1);
+    int size = bytes2quint16(frame.constData() + 2);
+    quint32 chk = bytes2quint32(frame.constData() + 4);
+    QByteArray data = frame.mid(8);
+    if(data.size() != size){
+        return;
+    }
+
+    const char *params = data.constData();
+
+    switch(cmd){
+    case 0x08: // SYNC
+        if(size < 4 || !data.startsWith("\x07\x07\x12\x20")){
+            return;
+        }
+        for(int i = 0; i < m_syncReplies; i++){
+            reply(cmd);
+        }
+        break;
+    case 0x0a: // READ_REG
+        if(size < 4){
+            reply(cmd, 0, StatusInvalidCommand);
+            return;
+        }
+        reply(cmd, m_regs.value(bytes2quint32(params)));
+        break;
+    case 0x09: { // WRITE_REG
+        if(size < 16){
+            reply(cmd, 0, StatusInvalidCommand);
+            return;
+        }
+        quint32 addr = bytes2quint32(params);
+        quint32 value = bytes2quint32(params + 4);
+        quint32 mask = bytes2quint32(params + 8);
+        m_regs[addr] = (m_regs.value(addr) & ~mask) | (value & mask);
+        if(addr == SPI_CMD_REG && (value & SPI_CMD_RDID)){
+            m_regs[SPI_W0_REG] = EMULATED_FLASH_ID;
+            m_regs[SPI_CMD_REG] = 0;
+        }
+        reply(cmd);
+        break;
+    }
+    case 0x05: // MEM_BEGIN
+        if(size < 16){
+            reply(cmd, 0, StatusInvalidCommand);
+            return;
+        }
+        m_ram.clear();
+        m_memBlockSize = bytes2quint32(params + 8);
+        m_memOffset = bytes2quint32(params + 12);
+        reply(cmd);
+        break;
+    case 0x07: // MEM_DATA
+    case 0x03: { // FLASH_DATA
+        if(size < 16 || (int)bytes2quint32(params) != size - 16){
+            reply(cmd, 0, StatusInvalidCommand);
+            return;
+        }
+        QByteArray block = data.mid(16);
+        if(Tools::checksum(block) != (chk & 0xff)){
+            reply(cmd, 0, StatusChecksum);
+            return;
+        }
+        quint32 seq = bytes2quint32(params + 4);
+        if(cmd == 0x07){
+            int offset = seq * m_memBlockSize;
+            if(m_ram.size() < offset + block.size()){
+                m_ram.resize(offset + block.size());
+            }
+            m_ram.replace(offset, block.size(), block);
+        } else {
+            quint32 offset = m_flashOffset + seq * m_flashBlockSize;
+            if(offset + block.size() > (quint32)m_flash.size()){
+                reply(cmd, 0, StatusFailed);
+                return;
+            }
+            flashWrite(offset, block);
+        }
+        reply(cmd);
+        break;
+    }
+    case 0x06: // MEM_END
+        if(size < 8){
+            reply(cmd, 0, StatusInvalidCommand);
+            return;
+        }
+        reply(cmd);
+        if(bytes2quint32(params) == 0){
+            runRam(bytes2quint32(params + 4));
+        }
+        break;
+    case 0x02: { // FLASH_BEGIN
+        if(size < 16){
+            reply(cmd, 0, StatusInvalidCommand);
+            return;
+        }
+        quint32 eraseSize = bytes2quint32(params);
+        m_flashBlockSize = bytes2quint32(params + 8);
+        m_flashOffset = bytes2quint32(params + 12);
+        if(m_flashOffset + eraseSize > (quint32)m_flash.size()){
+            reply(cmd, 0, StatusFailed);
+            return;
+        }
+        reply(cmd, 0, StatusOK, romErase(m_flashOffset, eraseSize));
+        break;
+    }
+    case 0x04: // FLASH_END
+        reply(cmd);
+        if(size >= 4 && bytes2quint32(params) == 0){
+            emit message("Reboot requested, staying in the bootloader");
+        }
+        break;
+    default:
+        reply(cmd, 0, StatusInvalidCommand);
+        break;
+    }
+}
+
+qint64 RomEmulator::romErase(quint32 offset, quint32 size)
+{
+    if(size == 0){
+        return 0;
+    }
+
+    // The ROM erases the head up to the next 64 KB block twice: once on its
+    // own and once more as part of the count it was given
+    quint32 first = offset / ESP_FLASH_SECTOR;
+    quint32 count = Tools::divRoundup(size, ESP_FLASH_SECTOR);
+    quint32 head = qMin<quint32>(16 - first % 16, count);
+    quint32 sectors = head + count;
+
+    quint32 start = first * ESP_FLASH_SECTOR;
+    quint32 length = qMin<quint32>(sectors * ESP_FLASH_SECTOR, m_flash.size() - start);
+    memset(m_flash.data() + start, 0xff, length);
+
+    return sectors * m_sectorEraseTime;
+}
+
+void RomEmulator::flashWrite(quint32 offset, const QByteArray &data)
+{
+    // NOR flash: programming can only clear bits
+    char *flash = m_flash.data() + offset;
+    for(int i = 0; i < data.size(); i++){
+        flash[i] &= data.at(i);
+    }
+}
+
+void RomEmulator::runRam(quint32 entry)
+{
+    if(entry == ROM_SFLASH_ENTRY && m_memOffset == ROM_STUB_ADDRESS && m_ram.size() >= 12){
+        // The sflash stub keeps its parameters in front of the code
+        quint32 offset = bytes2quint32(m_ram.constData());
+        quint32 size = bytes2quint32(m_ram.constData() + 4);
+        quint32 count = bytes2quint32(m_ram.constData() + 8);
+        for(quint32 i = 0; i < count; i++){
+            QByteArray block = m_flash.mid(offset + i * size, size);
+            block.append(QByteArray(size - block.size(), '\xff'));
+            send(block);
+        }
+        return;
+    }
+
+    if(entry == ROM_CHIP_ERASE){
+        m_flash.fill('\xff');
+        return;
+    }
+
+    if(entry == ROM_DIO_UNLOCK){
+        return;
+    }
+
+    emit message(QString("Jump to unsupported code at 0x%1, staying in the bootloader").arg(entry, 8, 16, QChar('0')));
+}
+
+} //namespace ESPFlasher
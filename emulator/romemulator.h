@@ -0,0 +1,123 @@
+#ifndef ROMEMULATOR_H
+#define ROMEMULATOR_H
+
+/*
+ * ESP8266 ROM bootloader on the master side of a pseudo-terminal: ESPRom
+ * opens the slave side like any serial port. The flash is kept in memory,
+ * the serial link is paced at a virtual baud rate and faults can be
+ * injected to exercise the host's error paths.
+ */
+
+#include <QObject>
+#include <QHash>
+#include <QList>
+#include <QElapsedTimer>
+
+#include "slipcodec.h"
+
+class QSocketNotifier;
+class QTimer;
+
+namespace ESPFlasher {
+
+class RomEmulator : public QObject
+{
+    Q_OBJECT
+public:
+    explicit RomEmulator(QObject *parent = 0);
+    ~RomEmulator();
+
+    // Opens the pty, and symlinks its slave to linkPath when given
+    bool open(const QString &linkPath = QString());
+    QString portName() const { return m_portName; }
+    QString errorText() const { return m_errorText; }
+
+    void setFlash(const QByteArray &flash) { m_flash = flash; }
+    QByteArray flash() const { return m_flash; }
+
+    // 0 disables pacing, the pty then runs as fast as the host reads
+    void setBaudRate(int baudRate) { m_baudRate = baudRate; }
+    void setLatency(int ms) { m_latency = ms * 1000; }
+    void setSectorEraseTime(int ms) { m_sectorEraseTime = ms * 1000; }
+    void setSyncReplies(int count) { m_syncReplies = count; }
+    void setDropRate(double rate) { m_dropRate = rate; }
+    void setCorruptRate(double rate) { m_corruptRate = rate; }
+    void setSeed(quint32 seed);
+
+    QString statistics() const;
+
+signals:
+    void message(const QString &text);
+
+private slots:
+    void readInput();
+    void runEvents();
+
+private:
+    struct Event {
+        qint64 due;
+        bool incoming;
+        QByteArray data;
+    };
+
+    enum Status {
+        StatusOK = 0x00,
+        StatusInvalidCommand = 0x05,
+        StatusFailed = 0x06,
+        StatusChecksum = 0x07
+    };
+
+    qint64 now() const { return m_clock.nsecsElapsed() / 1000; }
+    qint64 wireTime(int bytes) const;
+    void schedule(qint64 due, bool incoming, const QByteArray &data);
+    void handleFrame(const QByteArray &frame);
+    void reply(quint8 cmd, quint32 value = 0, Status status = StatusOK, qint64 busy = 0);
+    void send(const QByteArray &data, qint64 busy = 0);
+    qint64 romErase(quint32 offset, quint32 size);
+    void flashWrite(quint32 offset, const QByteArray &data);
+    void runRam(quint32 entry);
+    bool chance(double rate);
+
+private:
+    QString m_portName;
+    QString m_linkPath;
+    QString m_errorText;
+    int m_master;
+    int m_slave;
+    QSocketNotifier *m_notifier;
+    QTimer *m_timer;
+    QElapsedTimer m_clock;
+    QList<Event> m_events;
+    qint64 m_rxFree;
+    qint64 m_txFree;
+
+    SlipDecoder m_decoder;
+    SlipEncoder m_encoder;
+
+    int m_baudRate;
+    qint64 m_latency;
+    qint64 m_sectorEraseTime;
+    int m_syncReplies;
+    double m_dropRate;
+    double m_corruptRate;
+    quint32 m_random;
+
+    QByteArray m_flash;
+    QHash<quint32, quint32> m_regs;
+    QByteArray m_ram;
+    quint32 m_memOffset;
+    quint32 m_memBlockSize;
+    quint32 m_flashOffset;
+    quint32 m_flashBlockSize;
+
+    qint64 m_framesIn;
+    qint64 m_framesOut;
+    qint64 m_bytesIn;
+    qint64 m_bytesOut;
+    qint64 m_dropped;
+    qint64 m_corrupted;
+};
+
+} //namespace ESPFlasher
+
+#endif // ROMEMULATOR_H
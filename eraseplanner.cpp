@@ -0,0 +1,86 @@
+#include "eraseplanner.h"
+
+namespace ESPFlasher {
+
+// Worst case erase times of common SPI NOR parts (W25Q, GD25Q)
+#define SECTOR_ERASE_TIME   400
+#define BLOCK_ERASE_TIME    2000
+
+// Only whole blocks inside the range are block erased, so a block erase
+// always replaces all of its sectors and is the cheaper of the two
+static_assert(BLOCK_ERASE_TIME < (ESP_FLASH_ERASE_BLOCK / ESP_FLASH_SECTOR) * SECTOR_ERASE_TIME,
+              "a block erase must be cheaper than erasing its sectors");
+
+QList<EraseOp> ErasePlanner::plan(quint32 offset, quint32 size)
+{
+    QList<EraseOp> ops;
+    if(size == 0){
+        return ops;
+    }
+
+    quint64 start = offset - offset % ESP_FLASH_SECTOR;
+    quint64 end = ((quint64)offset + size + ESP_FLASH_SECTOR - 1) / ESP_FLASH_SECTOR * ESP_FLASH_SECTOR;
+
+    while(start < end)
+    {
+        quint64 blockEnd = start - start % ESP_FLASH_ERASE_BLOCK + ESP_FLASH_ERASE_BLOCK;
+        bool block = start % ESP_FLASH_ERASE_BLOCK == 0 && blockEnd <= end;
+        quint64 next = qMin(blockEnd, end);
+
+        // Runs of the same kind are merged, the erase commands take a range
+        if(!ops.isEmpty() && ops.last().block == block){
+            ops.last().size += next - start;
+        } else {
+            EraseOp op;
+            op.offset = start;
+            op.size = next - start;
+            op.block = block;
+            ops.append(op);
+        }
+
+        start = next;
+    }
+
+    return ops;
+}
+
+int ErasePlanner::eraseTime(const EraseOp &op)
+{
+    if(op.block){
+        return op.size / ESP_FLASH_ERASE_BLOCK * BLOCK_ERASE_TIME;
+    }
+
+    return op.size / ESP_FLASH_SECTOR * SECTOR_ERASE_TIME;
+}
+
+int ErasePlanner::eraseTime(const QList<EraseOp> &ops)
+{
+    int time = 0;
+    for(int i = 0; i < ops.size(); i++){
+        time += eraseTime(ops.at(i));
+    }
+
+    return time;
+}
+
+quint32 ErasePlanner::romEraseSize(quint32 offset, quint32 size)
+{
+    // The ROM erases sector by sector up to the first block boundary and then
+    // block by block, but counts the head sectors twice: once while erasing
+    // them and again when it subtracts them from the total. Passing a smaller
+    // size makes the ROM end its erase where the range ends.
+    quint32 sectorsPerBlock = ESP_FLASH_ERASE_BLOCK / ESP_FLASH_SECTOR,
+            numSectors = Tools::divRoundup(size, ESP_FLASH_SECTOR),
+            startSector = offset / ESP_FLASH_SECTOR,
+            headSectors = sectorsPerBlock - (startSector % sectorsPerBlock);
+
+    if (numSectors < headSectors)
+        headSectors = numSectors;
+
+    if (numSectors < 2 * headSectors)
+        return (numSectors + 1) / 2 * ESP_FLASH_SECTOR;
+
+    return (numSectors - headSectors) * ESP_FLASH_SECTOR;
+}
+
+} //namespace ESPFlasher
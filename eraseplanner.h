@@ -0,0 +1,39 @@
+#ifndef ERASEPLANNER_H
+#define ERASEPLANNER_H
+
+#include <QList>
+
+#include "tools.h"
+
+namespace ESPFlasher {
+
+// Largest erasable unit of the SPI flash, ESP_FLASH_SECTOR is the smallest
+#define ESP_FLASH_ERASE_BLOCK   0x10000
+
+struct EraseOp {
+    quint32 offset;
+    quint32 size;
+    bool block;     // 64 KB block erases, otherwise 4 KB sector erases
+};
+
+/*
+ * Splits a flash range into block erases for the whole blocks it covers and
+ * sector erases for the rest. The range is widened to whole sectors,
+ * nothing outside them is erased.
+ */
+class ErasePlanner
+{
+public:
+    static QList<EraseOp> plan(quint32 offset, quint32 size);
+
+    // Worst case duration of the erases, in milliseconds
+    static int eraseTime(const EraseOp &op);
+    static int eraseTime(const QList<EraseOp> &ops);
+
+    // Size to pass to the ROM FLASH_BEGIN so that it erases [offset, offset + size)
+    static quint32 romEraseSize(quint32 offset, quint32 size);
+};
+
+} //namespace ESPFlasher
+
+#endif // ERASEPLANNER_H
@@ -33,7 +33,19 @@ SOURCES += main.cpp\
     makeimagedialog.cpp \
     versiondialog.cpp \
     imagefilelistview.cpp \
-    preferencesdialog.cpp
+    preferencesdialog.cpp \
+    slipcodec.cpp \
+    espsession.cpp \
+    flasherstub.cpp \
+    eraseplanner.cpp \
+    protocoltrace.cpp \
+    commandstats.cpp \
+    commandlineengine.cpp \
+    flashjob.cpp \
+    preparedimagecache.cpp \
+    gangflasher.cpp \
+    gangdialog.cpp \
+    serialportwatcher.cpp
 
 HEADERS  += mainwindow.h \
     elffile.h \
@@ -51,14 +63,27 @@ HEADERS  += mainwindow.h \
     versiondialog.h \
     imagefilelistview.h \
     constants.h \
-    preferencesdialog.h
+    preferencesdialog.h \
+    slipcodec.h \
+    espsession.h \
+    flasherstub.h \
+    eraseplanner.h \
+    protocoltrace.h \
+    commandstats.h \
+    commandlineengine.h \
+    flashjob.h \
+    preparedimagecache.h \
+    gangflasher.h \
+    gangdialog.h \
+    serialportwatcher.h
 
 FORMS    += mainwindow.ui \
     imagechooser.ui \
     imageinfodialog.ui \
     flashinputdialog.ui \
     makeimagedialog.ui \
-    preferencesdialog.ui
+    preferencesdialog.ui \
+    gangdialog.ui
 
 RESOURCES += \
     resource.qrc
@@ -1,8 +1,16 @@
 #include "esprom.h"
+#include "flasherstub.h"
+#include "eraseplanner.h"
 #include "tools.h"
 
 #include <QThread>
 #include <QDataStream>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QVector>
+#include <QCryptographicHash>
+#include <QSettings>
+#include <QSerialPortInfo>
 #include <QDebug>
 
 namespace ESPFlasher {
@@ -10,24 +18,52 @@ namespace ESPFlasher {
 ESPRom::ESPRom(QObject *parent):
     QSerialPort(parent),
     m_waitTimeout(500),
+    m_syncTimeout(100),
     m_isSync(false),
     m_flashID(0),
     m_resetMode(1)
 {
-
+    init();
 }
 
 ESPRom::ESPRom(const QString &portName, const QSerialPort::BaudRate baudRate, int resetMode, QObject *parent) :
     QSerialPort(parent),
     m_waitTimeout(500),
+    m_syncTimeout(100),
     m_isSync(false),
     m_flashID(0),
     m_resetMode(resetMode)
 {
-    setPortName(portName);
-    setBaudRate(baudRate);
+    init();
+
+    setSerialPort(portName, baudRate);
+}
 
-    connect(this, SIGNAL(readyRead()), this, SLOT(readData()));
+void ESPRom::init()
+{
+    m_targetBaudRate = baudRate();
+    m_stubRunning = false;
+    m_flashWindow = 1;
+    m_flashAcked = 0;
+    m_flashPending = 0;
+    m_flashFailed = false;
+    m_deflBlockTimeout = m_waitTimeout;
+    m_encoder = SlipEncoder(2 * (ESP_RAM_BLOCK + 24) + 2);
+    m_nextCommandId = 0;
+    m_rxCount = 0;
+    m_lateCmd = 0;
+    m_lateResponses = 0;
+    m_lateUntil = 0;
+    m_eraseScale = 1.0;
+    m_sessionStats = CommandStats(&m_stats);
+    m_clock.start();
+
+    m_timeoutTimer = new QTimer(this);
+    m_timeoutTimer->setSingleShot(true);
+
+    connect(m_timeoutTimer, SIGNAL(timeout()), this, SLOT(expireCommands()));
+    connect(this, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
+    connect(this, SIGNAL(bytesWritten(qint64)), this, SLOT(onBytesWritten(qint64)));
     connect(this, SIGNAL(error(QSerialPort::SerialPortError)), this,
             SLOT(handleSerialError(QSerialPort::SerialPortError)));
 }
@@ -43,20 +79,82 @@ bool ESPRom::openPort()
     if(isPortOpen())
         return true;
 
+    bool highSpeed = !m_stubFile.isEmpty() && m_targetBaudRate > ESP_ROM_BAUD;
+    qint32 baudRate = highSpeed ? ESP_ROM_BAUD : m_targetBaudRate;
+    if(!connectDevice(baudRate)){
+        return false;
+    }
+
+    if(m_stubFile.isEmpty()){
+        return true;
+    }
+
+    if(!runStub()){
+        return reconnectRom(baudRate);
+    }
+
+    if(!highSpeed){
+        return true;
+    }
+
+    if(!negotiateBaudRate(m_targetBaudRate)){
+        emit message(QString("Link lost while changing baud rate, reconnecting at %1").arg(ESP_ROM_BAUD));
+        closePort();
+        if(!connectDevice(ESP_ROM_BAUD)){
+            return false;
+        }
+        if(!runStub()){
+            return reconnectRom(ESP_ROM_BAUD);
+        }
+    }
+
+    return true;
+}
+
+bool ESPRom::reconnectRom(qint32 baudRate)
+{
+    // A failed stub start may have left the ROM loader behind: reset back into it
+    emit message("Flasher stub failed, reconnecting to the ROM loader");
+    closePort();
+    return connectDevice(baudRate);
+}
+
+bool ESPRom::connectDevice(qint32 baudRate)
+{
+    setBaudRate(baudRate);
     setDataBits(QSerialPort::Data8);
     setParity(QSerialPort::NoParity);
     setStopBits(QSerialPort::OneStop);
     setFlowControl(QSerialPort::NoFlowControl);
 
 
+    m_decoder.reset();
+
     if (open(QIODevice::ReadWrite)) {
+        m_trace.mark(QString("open %1 %2").arg(portName()).arg(baudRate));
+
+        QElapsedTimer timer;
+        timer.start();
+
+        QString adapter = adapterKey();
+        int bootTime = -1;
+        QList<int> modes = resetModes(adapter, &bootTime);
 
         for(int i = 0; i < 4; i++){
+            int mode = modes.at(i % modes.size());
+            resetDevice(mode);
 
-            resetDevice(m_resetMode);
+            // The ROM prints its banner once out of reset: stop waiting there
+            int banner = waitForBoot(bootTime < 0 ? 150 : 2 * bootTime + 20);
 
-            for(int i = 0; i < 4; i++){
+            for(int j = 0; j < 4; j++){
                 if(sync()){
+                    emit message(QString("Synced in %1 ms (reset mode %2, %3 reset(s))")
+                                 .arg(timer.elapsed()).arg(mode).arg(i + 1));
+                    // A manual boot says nothing about how the adapter resets
+                    if(mode != None){
+                        saveResetProfile(adapter, mode, banner);
+                    }
                     return true;
                 }
             }
@@ -70,8 +168,87 @@ bool ESPRom::openPort()
     return false;
 }
 
+int ESPRom::waitForBoot(int timeout)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    int bootTime = -1;
+    while(timer.elapsed() < timeout){
+        if(waitForReadyRead(qMax<qint64>(1, timeout - timer.elapsed()))){
+            bootTime = timer.elapsed();
+            break;
+        }
+    }
+
+    // The banner is sent at 74880 baud, what we got is noise to the decoder
+    if(bootTime >= 0){
+        while(waitForReadyRead(5)){}
+    }
+    clear(QSerialPort::Input);
+    m_decoder.reset();
+
+    return bootTime;
+}
+
+QString ESPRom::adapterKey() const
+{
+    QSerialPortInfo info(*this);
+    if(info.hasVendorIdentifier() && info.hasProductIdentifier()){
+        return QString("%1_%2").arg(info.vendorIdentifier(), 4, 16, QChar('0'))
+                .arg(info.productIdentifier(), 4, 16, QChar('0'));
+    }
+
+    return info.portName();
+}
+
+QList<int> ESPRom::resetModes(const QString &adapter, int *bootTime) const
+{
+    QList<int> modes;
+
+    // Boards wired for manual boot are never toggled behind the user's back
+    if(m_resetMode == None){
+        modes << None;
+        return modes;
+    }
+
+    // What worked last time on this adapter goes first
+    QSettings settings;
+    settings.beginGroup("resetProfiles");
+    if(settings.contains(adapter + "/mode")){
+        modes << settings.value(adapter + "/mode").toInt();
+        *bootTime = settings.value(adapter + "/bootTime", -1).toInt();
+    }
+    settings.endGroup();
+
+    if(!modes.contains(m_resetMode)){
+        modes << m_resetMode;
+    }
+
+    QList<int> others;
+    others << Auto << NodeMCU << CK << DTROnly;
+    for(int i = 0; i < others.size(); i++){
+        if(!modes.contains(others.at(i))){
+            modes << others.at(i);
+        }
+    }
+
+    return modes;
+}
+
+void ESPRom::saveResetProfile(const QString &adapter, int mode, int bootTime) const
+{
+    QSettings settings;
+    settings.beginGroup("resetProfiles");
+    settings.setValue(adapter + "/mode", mode);
+    settings.setValue(adapter + "/bootTime", bootTime);
+    settings.endGroup();
+}
+
 void ESPRom::resetDevice(int mode)
 {
+    m_trace.mark(QString("reset %1").arg(mode));
+
     switch (static_cast<ResetMode>(mode))
     {
     case Auto:
@@ -141,6 +318,26 @@ void ESPRom::resetDevice(int mode)
     }
 }
 
+bool ESPRom::setTraceFile(const QString &fileName)
+{
+    if(fileName.isEmpty()){
+        m_trace.close();
+        return true;
+    }
+
+    return m_trace.open(fileName);
+}
+
+QJsonObject ESPRom::statistics(bool session) const
+{
+    QJsonObject json = (session ? m_sessionStats : m_stats).toJson();
+    json["port"] = portName();
+    json["baud_rate"] = baudRate();
+    json["mac"] = m_macAddress;
+    json["stub"] = m_stubRunning;
+    return json;
+}
+
 bool ESPRom::sync()
 {
 
@@ -149,10 +346,9 @@ bool ESPRom::sync()
         packet.append("\x55", 1);
     }
 
-    if(sendCommand(Sync, packet).isValid()){
-        for(int i = 0; i < 8; i++){
-            sendCommand();
-        }
+    // The ROM answers a SYNC several times, the extra replies are dropped as
+    // stale responses by the command engine.
+    if(sendCommand(Sync, packet.constData(), packet.size(), 0, 0, 0, m_syncTimeout).isValid()){
         m_isSync = true;
         return true;
     }
@@ -165,7 +361,16 @@ void ESPRom::closePort()
     if(isOpen()){
         m_isSync = false;
         close();
+        m_trace.mark("close");
     }
+
+    m_macAddress.clear();
+    m_flashID = 0;
+    m_stubRunning = false;
+    m_rtt.clear();
+    cancelCommands();
+    m_decoder.reset();
+    m_lateResponses = 0;
 }
 
 qint64	ESPRom::readData(char * data, qint64 maxSize)
@@ -182,7 +387,7 @@ void ESPRom::handleSerialError(QSerialPort::SerialPortError error)
 {
     if (error == QSerialPort::ResourceError) {
         close();
-
+        cancelCommands();
     }
 
     if(error != QSerialPort::NoError){
@@ -190,53 +395,308 @@ void ESPRom::handleSerialError(QSerialPort::SerialPortError error)
     }
 }
 
-QByteArray ESPRom::readBytes(int size)
+void ESPRom::onReadyRead()
 {
-    waitForReadyRead(10);
+    QByteArray data = readAll();
+    if(data.isEmpty()){
+        return;
+    }
+
+    m_rxCount += data.size();
+    m_trace.record(TraceRecord::Received, data.constData(), data.size());
+    m_decoder.feed(data);
+
+    while(m_decoder.hasFrame()){
+        QByteArray frame = m_decoder.takeFrame();
 
-    QByteArray bytes = read(size);
+        // Raw data frames (sflash read stub) once no command is waiting
+        if(m_inFlight.isEmpty() && m_frameHandler){
+            m_sessionStats.streamed(frame.size());
+            m_frameHandler(frame);
+            continue;
+        }
+
+        CommandResponse response = parseResponse(frame);
+        if(response.error() != CommandResponse::ResponseOK){
+            continue;
+        }
 
-    return bytes;
+        // Responses only carry the command, a late one to an expired command
+        // would answer the next command of its kind and shift all later ones.
+        // They come in order, anything else means they were lost.
+        if(m_lateResponses > 0 && m_clock.elapsed() <= m_lateUntil && response.cmd == m_lateCmd){
+            m_lateResponses--;
+            continue;
+        }
+        m_lateResponses = 0;
+
+        if(!m_inFlight.isEmpty() && response.cmd == (quint8)m_inFlight.head().cmd){
+            completeCommand(response);
+        }
+        // Anything else is a stale or corrupted response and is dropped
+    }
 }
 
-QByteArray ESPRom::readAndEscape(int size)
-{    
-    qint64 readCount = 0;
-    QByteArray data;
-    while((data.size() < size))
+void ESPRom::onBytesWritten(qint64 bytes)
+{
+    Q_UNUSED(bytes);
+    pumpQueue();
+}
+
+quint32 ESPRom::enqueueCommand(ESPCommand cmd, const QByteArray &data, quint32 chk,
+                               const ResponseCallback &callback, int timeout)
+{
+    return enqueueCommand(cmd, data, QByteArray(), chk, callback, timeout);
+}
+
+quint32 ESPRom::enqueueCommand(ESPCommand cmd, const QByteArray &params, const QByteArray &payload, quint32 chk,
+                               const ResponseCallback &callback, int timeout)
+{
+    PendingCommand command;
+    command.id = ++m_nextCommandId;
+    command.cmd = cmd;
+    command.params = params;
+    command.payload = payload;
+    command.chk = chk;
+    command.timeout = timeout < 0 ? commandTimeout(cmd) : timeout;
+    command.adaptive = timeout < 0;
+    command.deadline = 0;
+    command.sentAt = 0;
+    command.writtenAt = 0;
+    command.callback = callback;
+
+    m_commandQueue.enqueue(command);
+    pumpQueue();
+
+    return command.id;
+}
+
+void ESPRom::pumpQueue()
+{
+    while(!m_commandQueue.isEmpty() && isOpen())
     {
-        waitForReadyRead(10);
-
-        char buffer[1];
-        readCount += read(buffer, 1);
-        if (buffer[0] == '\xdb')
-        {
-            readCount += read(buffer, 1);
-            if (buffer[0] == '\xdc')
-                data.append('\xc0');
-            else if (buffer[0] == '\xdd')
-                data.append('\xdb');
-            else{
-                qDebug() << "Invalid SLIP escape";
-                return data;
+        const PendingCommand &next = m_commandQueue.head();
+
+        // Only runs of one pipelined command share the link, up to its window
+        if(!m_inFlight.isEmpty()){
+            if(!isPipelined(next.cmd) || next.cmd != m_inFlight.head().cmd
+                    || m_inFlight.size() >= windowFor(next.cmd)){
+                break;
+            }
+            // Let the previous frame drain before queuing the next one
+            if(bytesToWrite() > m_encoder.size()){
+                break;
             }
         }
-        else{
-            data.append(buffer, 1);
-        }
+
+        PendingCommand command = m_commandQueue.dequeue();
+        writeCommand(command);
+        command.writtenAt = m_clock.nsecsElapsed() / 1000;
+        m_sessionStats.sent(command.cmd, m_encoder.size());
+
+        // Give the frame time to go over the wire before the timeout starts
+        qint64 wireTime = (bytesToWrite() * 10 * 1000) / qMax(baudRate(), 1);
+        command.sentAt = m_clock.elapsed() + wireTime;
+        command.deadline = command.sentAt + command.timeout;
+        command.params.clear();
+        command.payload.clear();
+        m_inFlight.enqueue(command);
     }
 
-    return data;
+    scheduleTimeout();
 }
 
-void ESPRom::writeToPort(QByteArray data)
+void ESPRom::writeCommand(const PendingCommand &command)
 {
-    QByteArray buf = "\xc0" + (data.replace("\xdb","\xdb\xdd").replace("\xc0","\xdb\xdc")) + "\xc0";
-    write(buf.data(), buf.size());
-    if (!waitForBytesWritten(m_waitTimeout)) {
-        //qDebug() << "Wait write response timeout";
+    char header[8];
+    header[0] = '\0';
+    header[1] = (char)command.cmd;
+    quint16toBytes(command.params.size() + command.payload.size(), &header[2]);
+    quint32toBytes(command.chk, &header[4]);
+
+    m_encoder.begin();
+    m_encoder.append(header, 8);
+    m_encoder.append(command.params.constData(), command.params.size());
+    m_encoder.append(command.payload.constData(), command.payload.size());
+    m_encoder.end();
+
+    m_trace.record(TraceRecord::Sent, m_encoder.constData(), m_encoder.size());
+    write(m_encoder.constData(), m_encoder.size());
+}
+
+void ESPRom::completeCommand(const CommandResponse &response)
+{
+    PendingCommand command = m_inFlight.dequeue();
+
+    if(response.error() == CommandResponse::Timeout){
+        m_sessionStats.timedOut(command.cmd);
+    } else {
+        m_sessionStats.completed(command.cmd, m_clock.nsecsElapsed() / 1000 - command.writtenAt,
+                                 8 + response.body.size(), response.isValid());
+    }
+
+    // Commands with a size based timeout would skew the estimate
+    if(command.adaptive && response.error() == CommandResponse::ResponseOK){
+        updateRtt(command.cmd, m_clock.elapsed() - command.sentAt);
+    }
+
+    // The callback may queue more commands, so the queues are consistent first
+    pumpQueue();
+
+    if(command.callback){
+        command.callback(response);
+    }
+}
+
+int ESPRom::commandTimeout(ESPCommand cmd) const
+{
+    if(!m_rtt.contains(cmd)){
+        return m_waitTimeout;
+    }
+
+    const RttEstimate &rtt = m_rtt[cmd];
+    return qBound<qint64>(ESP_MIN_TIMEOUT, rtt.srtt + 4 * rtt.rttvar, m_waitTimeout);
+}
+
+void ESPRom::updateRtt(ESPCommand cmd, qint64 rtt)
+{
+    rtt = qMax<qint64>(rtt, 1);
+
+    if(!m_rtt.contains(cmd)){
+        RttEstimate estimate;
+        estimate.srtt = rtt;
+        estimate.rttvar = rtt / 2;
+        m_rtt.insert(cmd, estimate);
         return;
     }
+
+    RttEstimate &estimate = m_rtt[cmd];
+    estimate.rttvar = (3 * estimate.rttvar + qAbs(estimate.srtt - rtt)) / 4;
+    estimate.srtt = (7 * estimate.srtt + rtt) / 8;
+}
+
+int ESPRom::eraseTimeout(const QList<EraseOp> &ops) const
+{
+    // Twice what this chip has needed so far, never above the worst case
+    int worstCase = ErasePlanner::eraseTime(ops);
+    int expected = qMin<double>(worstCase, 2 * m_eraseScale * worstCase);
+
+    return commandTimeout(FlashBegin) + qMax(m_waitTimeout, expected);
+}
+
+void ESPRom::updateEraseScale(const QList<EraseOp> &ops, qint64 elapsed)
+{
+    int worstCase = ErasePlanner::eraseTime(ops);
+    if(worstCase == 0){
+        return;
+    }
+
+    // The round trip is not part of the erase
+    if(m_rtt.contains(FlashBegin)){
+        elapsed -= m_rtt[FlashBegin].srtt;
+    }
+
+    double scale = qBound(0.05, (double)elapsed / worstCase, 1.0);
+    m_eraseScale = (3 * m_eraseScale + scale) / 4;
+}
+
+void ESPRom::scheduleTimeout()
+{
+    if(m_inFlight.isEmpty()){
+        m_timeoutTimer->stop();
+        return;
+    }
+
+    qint64 deadline = m_inFlight.head().deadline;
+    for(int i = 1; i < m_inFlight.size(); i++){
+        deadline = qMin(deadline, m_inFlight.at(i).deadline);
+    }
+
+    m_timeoutTimer->start((int)qMax<qint64>(0, deadline - m_clock.elapsed()));
+}
+
+void ESPRom::expireCommands()
+{
+    qint64 now = m_clock.elapsed();
+
+    // Responses are matched in order, once one is lost the rest of the window
+    // cannot be told apart from late ones and fails with it
+    if(!m_inFlight.isEmpty() && m_inFlight.head().deadline <= now){
+        int window = m_inFlight.size();
+        for(int i = 0; i < window && !m_inFlight.isEmpty(); i++){
+            expectLateResponse(m_inFlight.head().cmd);
+            completeCommand(CommandResponse::Timeout);
+        }
+    }
+
+    scheduleTimeout();
+}
+
+void ESPRom::expectLateResponse(ESPCommand cmd)
+{
+    if(m_lateResponses == 0 || m_lateCmd != (quint8)cmd){
+        m_lateResponses = 0;
+    }
+    m_lateCmd = cmd;
+    m_lateResponses++;
+    m_lateUntil = m_clock.elapsed() + m_waitTimeout;
+}
+
+void ESPRom::cancelCommands()
+{
+    QQueue<PendingCommand> commands = m_inFlight;
+    commands.append(m_commandQueue);
+    m_inFlight.clear();
+    m_commandQueue.clear();
+    m_timeoutTimer->stop();
+
+    for(int i = 0; i < commands.size(); i++){
+        m_sessionStats.cancelled(commands.at(i).cmd);
+        if(commands.at(i).callback){
+            commands.at(i).callback(CommandResponse::Cancelled);
+        }
+    }
+}
+
+bool ESPRom::waitFor(const std::function<bool ()> &done, int idleTimeout)
+{
+    QElapsedTimer idle;
+    idle.start();
+    qint64 rxCount = m_rxCount;
+
+    while(!done())
+    {
+        if(!isOpen()){
+            cancelCommands();
+            return done();
+        }
+
+        qint64 wait = m_waitTimeout;
+        if(!m_inFlight.isEmpty()){
+            wait = qMin<qint64>(wait, m_timeoutTimer->remainingTime());
+        }
+        if(idleTimeout >= 0){
+            qint64 left = idleTimeout - idle.elapsed();
+            if(left <= 0){
+                return false;
+            }
+            wait = qMin(wait, left);
+        }
+
+        // Also pushes pending writes out, emitting bytesWritten() on the way
+        waitForReadyRead(qMax<qint64>(wait, 1));
+        if(bytesAvailable() > 0){
+            onReadyRead();
+        }
+        expireCommands();
+
+        if(m_rxCount != rxCount){
+            rxCount = m_rxCount;
+            idle.restart();
+        }
+    }
+
+    return true;
 }
 
 QString ESPRom::errorText(CommandResponse response)
@@ -251,6 +711,12 @@ QString ESPRom::errorText(CommandResponse response)
     case CommandResponse::InvalidPacketEnd:
         return QLatin1String("Invalid end of packet");
         break;
+    case CommandResponse::Timeout:
+        return QLatin1String("Timed out waiting for response");
+        break;
+    case CommandResponse::Cancelled:
+        return QLatin1String("Command cancelled");
+        break;
     default:
         break;
     }
@@ -258,48 +724,54 @@ QString ESPRom::errorText(CommandResponse response)
     return QString();
 }
 
-CommandResponse ESPRom::sendCommand(ESPCommand cmd, const char *data, quint16 size, quint32 chk)
+CommandResponse ESPRom::transact(ESPCommand cmd, const char *data, quint16 size, quint32 chk,
+                                 const char *payload, quint16 payloadSize, int timeout)
 {
-    emit commandStarted(cmd);
-
-    if(cmd != NoCommand){
-        QByteArray buffer;
-        buffer.append('\0');
-        buffer.append((char)cmd);
-
-        char sizeBytes[2];
-        quint16toBytes(size, sizeBytes);
-        buffer.append(sizeBytes, 2);
+    CommandResponse response(CommandResponse::Cancelled);
+
+    // Timeouts are tight once the link is measured, commands that can be
+    // repeated safely get retried instead of failing the operation
+    for(int attempt = 0; attempt < (isIdempotent(cmd) ? 3 : 1); attempt++){
+        if(attempt > 0){
+            m_sessionStats.retried(cmd);
+            // Give the reply to the expired attempt a chance to arrive and be dropped
+            waitFor([this]{ return m_lateResponses == 0; }, commandTimeout(cmd));
+            m_lateResponses = 0;
+        }
 
-        char chkBytes[4];
-        quint32toBytes(chk, chkBytes);
-        buffer.append(chkBytes, 4);
-        buffer.append(data, size);
+        // Both buffers outlive the command since we wait for its completion
+        bool done = false;
+        enqueueCommand(cmd, QByteArray::fromRawData(data, size), QByteArray::fromRawData(payload, payloadSize), chk,
+                       [&response, &done](const CommandResponse &r){ response = r; done = true; }, timeout);
 
-        writeToPort(buffer);
+        if(!waitFor([&done]{ return done; })){
+            cancelCommands();
+        }
 
-        if(waitForReadyRead(m_waitTimeout)){
-            //TODO:
+        if(response.error() != CommandResponse::Timeout){
+            break;
         }
     }
 
-    int retries = 100;
-    CommandResponse response;
-    while (retries > 0){
-        response = receiveResponse();
+    return response;
+}
 
-        if(cmd == NoCommand || response.cmd == (quint8)cmd){
-            emit commandFinished(cmd);
-            return response;
-        }
-        retries--;
+CommandResponse ESPRom::sendCommand(ESPCommand cmd, const char *data, quint16 size, quint32 chk,
+                                    const char *payload, quint16 payloadSize, int timeout)
+{
+    emit commandStarted(cmd);
+
+    CommandResponse response = transact(cmd, data, size, chk, payload, payloadSize, timeout);
+    if(response.error() == CommandResponse::ResponseOK){
+        emit commandFinished(cmd);
+        return response;
     }
 
-    if(cmd != NoCommand && cmd != Sync){
+    if(cmd != Sync){
         emit commandError(errorText(response));
     }
 
-    return CommandResponse::InvalidResponse;
+    return response;
 }
 
 CommandResponse ESPRom::sendCommand(ESPCommand cmd, const QByteArray &data, quint32 chk)
@@ -307,27 +779,23 @@ CommandResponse ESPRom::sendCommand(ESPCommand cmd, const QByteArray &data, quin
     return sendCommand(cmd, data.data(), data.size(), chk);
 }
 
-CommandResponse ESPRom::receiveResponse()
+CommandResponse ESPRom::parseResponse(const QByteArray &frame)
 {
-    if(readBytes(1) != QByteArray("\xc0", 1)){
-        return CommandResponse::InvalidPacketHead;
-    }
-
-    QByteArray bytes = readAndEscape(8);
-    if(bytes.isEmpty() || bytes.at(0) != 0x01){
+    if(frame.size() < 8 || frame.at(0) != 0x01){
         return CommandResponse::InvalidResponse;
     }
 
     CommandResponse response;
-    response.cmd = bytes.at(1);
-    response.size = bytes2quint16(&bytes.data()[2]);
-    response.value = bytes2quint32(&bytes.data()[4]);
-    response.body = readAndEscape(response.size);
+    response.cmd = frame.at(1);
+    response.size = bytes2quint16(&frame.data()[2]);
+    response.value = bytes2quint32(&frame.data()[4]);
 
-    if(readBytes(1) != QByteArray("\xc0", 1)){
+    if(frame.size() < 8 + response.size){
         return CommandResponse::InvalidPacketEnd;
     }
 
+    response.body = frame.mid(8, response.size);
+
     return response;
 }
 
@@ -345,6 +813,59 @@ quint32 ESPRom::readReg(quint32 addr)
     return response.value;
 }
 
+bool ESPRom::readMemory(quint32 addr, quint32 size, QIODevice *sink)
+{
+    quint32 words = Tools::divRoundup(size, 4);
+    quint32 pending = 0, left = size;
+    bool failed = false;
+    int progress = -1;
+
+    emit commandStarted(ReadReg);
+
+    // Responses come back in order, so each word goes to the sink as it lands
+    for(quint32 i = 0; i < words && !failed; i++){
+        char bytes[4];
+        quint32toBytes(addr + i * 4, bytes);
+
+        pending++;
+        enqueueCommand(ReadReg, QByteArray(bytes, 4), 0,
+                       [&, sink, words, i](const CommandResponse &response){
+            pending--;
+            if(failed){
+                return;
+            }
+
+            char value[4];
+            quint32toBytes(response.value, value);
+            int length = qMin<quint32>(4, left);
+            if(!response.isValid() || sink->write(value, length) != length){
+                failed = true;
+                return;
+            }
+            left -= length;
+
+            if((int)(100 * (quint64)(i + 1) / words) != progress){
+                progress = 100 * (quint64)(i + 1) / words;
+                emit readProgress(progress);
+            }
+        });
+
+        waitFor([&]{ return failed || (int)pending < ESP_READ_REG_WINDOW; });
+    }
+
+    waitFor([&]{ return failed || pending == 0; });
+
+    if(failed || pending){
+        cancelCommands();
+        emit commandError("Failed to read target memory");
+        return false;
+    }
+
+    emit commandFinished(ReadReg);
+
+    return true;
+}
+
 bool ESPRom::writeReg(quint32 addr, quint32 value, quint32 mask, quint32 delayus)
 {
     char bytes[16];
@@ -385,11 +906,7 @@ bool ESPRom::memBlock(const QByteArray &data, quint32 seq)
     quint32toBytes(0, &bytes[8]);
     quint32toBytes(0, &bytes[12]);
 
-    QByteArray packet;
-    packet.append(bytes, 16);
-    packet.append(data);
-
-    if(!sendCommand(MemData, packet, Tools::checksum(data)).isValid()){
+    if(!sendCommand(MemData, bytes, 16, Tools::checksum(data), data.constData(), data.size()).isValid()){
         emit commandError("Failed to write to target RAM");
         return false;
     }
@@ -411,38 +928,58 @@ bool ESPRom::memFinish(quint32 entrypoint)
     return true;
 }
 
-bool ESPRom::flashBegin(quint32 size, quint32 offset)
+bool ESPRom::flashBegin(quint32 size, quint32 offset, bool erase)
 {
-    quint32 numBlocks = (size + ESP_FLASH_BLOCK - 1) / ESP_FLASH_BLOCK,
-            sectorsPerBlock = 16, sectorSize = 4096,
-            numSectors = (size + sectorSize - 1) / sectorSize,
-            startSector = offset / sectorSize,
-            headSectors = sectorsPerBlock - (startSector % sectorsPerBlock);
-
-    if (numSectors < headSectors)
-        headSectors = numSectors;
+    if(m_flashPending > 0){
+        flashFlush();
+    }
 
-    quint32 eraseSize;
-    if (numSectors < 2 * headSectors)
-        eraseSize = (numSectors + 1) / 2 * sectorSize;
-    else
-        eraseSize = (numSectors - headSectors) * sectorSize;
+    m_flashFailed = false;
+    m_flashAcked = 0;
+
+    quint32 numBlocks = (size + flashBlockSize() - 1) / flashBlockSize();
+
+    // The stub erases exactly what it is asked for while blocks come in and
+    // trims the data to that size, so it always gets the size. The ROM erases
+    // before answering and needs its quirk compensated
+    quint32 eraseSize = 0;
+    int timeout = -1;
+    QList<EraseOp> ops;
+    if (m_stubRunning){
+        eraseSize = size;
+    } else if (erase && size > 0){
+        ops = ErasePlanner::plan(offset, size);
+        eraseSize = ErasePlanner::romEraseSize(offset, size);
+        timeout = eraseTimeout(ops);
+    }
 
     char bytes[16];
     quint32toBytes(eraseSize, &bytes[0]);
     quint32toBytes(numBlocks, &bytes[4]);
-    quint32toBytes(ESP_FLASH_BLOCK, &bytes[8]);
+    quint32toBytes(flashBlockSize(), &bytes[8]);
     quint32toBytes(offset, &bytes[12]);
 
-    if(!sendCommand(FlashBegin, bytes, 16).isValid()){
+    qint64 started = m_clock.elapsed();
+    if(!sendCommand(FlashBegin, bytes, 16, 0, 0, 0, timeout).isValid()){
         emit commandError("Failed to enter Flash download mode");
         return false;
     }
+    updateEraseScale(ops, m_clock.elapsed() - started);
 
     return true;
 }
 
 bool ESPRom::flashBlock(const QByteArray &data, quint32 seq)
+{
+    return queueFlashBlock(FlashData, data, seq, Tools::checksum(data));
+}
+
+bool ESPRom::flashBlock(const QByteArray &data, quint32 seq, quint8 checksum)
+{
+    return queueFlashBlock(FlashData, data, seq, checksum);
+}
+
+bool ESPRom::queueFlashBlock(ESPCommand cmd, const QByteArray &data, quint32 seq, quint8 checksum, int timeout)
 {
     char bytes[16];
     quint32toBytes(data.size(), &bytes[0]);
@@ -450,12 +987,40 @@ bool ESPRom::flashBlock(const QByteArray &data, quint32 seq)
     quint32toBytes(0, &bytes[8]);
     quint32toBytes(0, &bytes[12]);
 
-    QByteArray packet;
-    packet.append(bytes, 16);
-    packet.append(data);
+    if(m_flashFailed){
+        return false;
+    }
+
+    emit commandStarted(cmd);
+
+    // FLASH_DATA acks carry no sequence number, the ROM answers blocks in order
+    m_flashPending++;
+    enqueueCommand(cmd, QByteArray(bytes, 16), data, checksum,
+                   [this, cmd, seq](const CommandResponse &response){
+        m_flashPending--;
+        if(m_flashFailed){
+            return;
+        }
+        if(!response.isValid()){
+            m_flashFailed = true;
+            emit commandError(QString("Failed to write to target Flash (seq %1)").arg(seq));
+            return;
+        }
+        m_flashAcked++;
+        emit commandFinished(cmd);
+    }, timeout);
+
+    waitFor([this]{ return m_flashFailed || m_flashPending < m_flashWindow; });
 
-    if(!sendCommand(FlashData, packet, Tools::checksum(data)).isValid()){
-        emit commandError("Failed to write to target Flash");
+    return !m_flashFailed;
+}
+
+bool ESPRom::flashFlush()
+{
+    waitFor([this]{ return m_flashFailed || m_flashPending == 0; });
+
+    if(m_flashFailed){
+        cancelCommands();
         return false;
     }
 
@@ -464,6 +1029,10 @@ bool ESPRom::flashBlock(const QByteArray &data, quint32 seq)
 
 bool ESPRom::flashFinish(bool reboot)
 {
+    if(!flashFlush()){
+        return false;
+    }
+
     char bytes[4];
     quint32toBytes((quint32)(!reboot), &bytes[0]);
 
@@ -475,6 +1044,245 @@ bool ESPRom::flashFinish(bool reboot)
     return true;
 }
 
+bool ESPRom::flashDeflBegin(quint32 size, quint32 compressedSize, quint32 offset)
+{
+    if(!m_stubRunning){
+        emit commandError("Compressed writes need the flasher stub");
+        return false;
+    }
+
+    if(m_flashPending > 0){
+        flashFlush();
+    }
+
+    m_flashFailed = false;
+    m_flashAcked = 0;
+
+    // The stub takes the uncompressed size and manages erasing itself
+    quint32 numBlocks = (compressedSize + flashBlockSize() - 1) / flashBlockSize();
+
+    char bytes[16];
+    quint32toBytes(size, &bytes[0]);
+    quint32toBytes(numBlocks, &bytes[4]);
+    quint32toBytes(flashBlockSize(), &bytes[8]);
+    quint32toBytes(offset, &bytes[12]);
+
+    // Each block may inflate to many erased and written sectors (~40 s per MB)
+    quint64 inflated = numBlocks ? (quint64)size / numBlocks : 0;
+    m_deflBlockTimeout = qMax<quint64>(m_waitTimeout, inflated * 40 / 1024);
+
+    if(!sendCommand(FlashDeflBegin, bytes, 16).isValid()){
+        emit commandError("Failed to enter compressed Flash download mode");
+        return false;
+    }
+
+    return true;
+}
+
+bool ESPRom::flashDeflBlock(const QByteArray &data, quint32 seq)
+{
+    return flashDeflBlock(data, seq, Tools::checksum(data));
+}
+
+bool ESPRom::flashDeflBlock(const QByteArray &data, quint32 seq, quint8 checksum)
+{
+    // The stub inflates and writes the blocks ahead of this one in the window
+    // before it gets to it, their time counts as well
+    return queueFlashBlock(FlashDeflData, data, seq, checksum, m_deflBlockTimeout * (m_flashPending + 1));
+}
+
+bool ESPRom::flashDeflFinish(bool reboot)
+{
+    if(!flashFlush()){
+        return false;
+    }
+
+    char bytes[4];
+    quint32toBytes((quint32)(!reboot), &bytes[0]);
+
+    if(!sendCommand(FlashDeflEnd, bytes, 4).isValid()){
+        emit commandError("Failed to leave compressed Flash mode");
+        return false;
+    }
+
+    return true;
+}
+
+QList<QByteArray> ESPRom::flashDigests(quint32 offset, quint32 size, quint32 sectorSize)
+{
+    if(!m_stubRunning){
+        emit commandError("Flash digests need the flasher stub");
+        return QList<QByteArray>();
+    }
+
+    quint32 count = Tools::divRoundup(size, sectorSize);
+    QList<QByteArray> digests;
+    digests.reserve(count);
+    for(quint32 i = 0; i < count; i++){
+        digests.append(QByteArray());
+    }
+    quint32 pending = 0;
+    bool failed = false;
+
+    emit commandStarted(SpiFlashMD5);
+
+    // The requests are independent, so they share the link like flash blocks
+    for(quint32 i = 0; i < count && !failed; i++){
+        quint32 length = qMin(sectorSize, size - i * sectorSize);
+
+        char bytes[16];
+        quint32toBytes(offset + i * sectorSize, &bytes[0]);
+        quint32toBytes(length, &bytes[4]);
+        quint32toBytes(0, &bytes[8]);
+        quint32toBytes(0, &bytes[12]);
+
+        pending++;
+        enqueueCommand(SpiFlashMD5, QByteArray(bytes, 16), 0,
+                       [&digests, &pending, &failed, i](const CommandResponse &response){
+            pending--;
+            // The stub returns the raw digest, the ROM would send it as hex
+            if(!response.isValid() || response.body.size() != 18){
+                failed = true;
+                return;
+            }
+            digests[i] = response.body.left(16);
+        });
+
+        waitFor([&]{ return failed || (int)pending < m_flashWindow; });
+    }
+
+    waitFor([&]{ return failed || pending == 0; });
+
+    if(failed || pending){
+        cancelCommands();
+        emit commandError("Failed to read Flash digests");
+        return QList<QByteArray>();
+    }
+
+    emit commandFinished(SpiFlashMD5);
+
+    return digests;
+}
+
+quint32 ESPRom::flashBlockSize() const
+{
+    return m_stubRunning ? ESP_STUB_FLASH_BLOCK : ESP_FLASH_BLOCK;
+}
+
+bool ESPRom::runStub()
+{
+    FlasherStub stub(m_stubFile);
+    if(!stub.isValid()){
+        emit message(QString("Flasher stub not loaded: %1").arg(stub.errorText()));
+        return false;
+    }
+
+    for(int i = 0; i < stub.segments().size(); i++){
+        Segment segment = stub.segments().at(i);
+        if(!memBegin(segment.size, Tools::divRoundup(segment.size, ESP_RAM_BLOCK), ESP_RAM_BLOCK, segment.offset)){
+            return false;
+        }
+
+        int seq = 0, pos = 0;
+        while(pos < segment.data.size()){
+            if(!memBlock(segment.data.mid(pos, ESP_RAM_BLOCK), seq)){
+                return false;
+            }
+            pos += ESP_RAM_BLOCK;
+            seq++;
+        }
+    }
+
+    // The stub greets with "OHAI" once it is running
+    bool greeted = false;
+    m_frameHandler = [&greeted](const QByteArray &frame){
+        if(frame == "OHAI"){
+            greeted = true;
+        }
+    };
+
+    bool ok = memFinish(stub.entryPoint()) && waitFor([&greeted]{ return greeted; }, 2 * m_waitTimeout);
+    m_frameHandler = nullptr;
+
+    if(!ok){
+        emit commandError("Flasher stub did not start");
+        return false;
+    }
+
+    m_stubRunning = true;
+    emit message("Flasher stub running");
+
+    return true;
+}
+
+bool ESPRom::changeBaudRate(qint32 baudRate)
+{
+    if(!m_stubRunning){
+        return false;
+    }
+
+    char bytes[8];
+    quint32toBytes(baudRate, &bytes[0]);
+    quint32toBytes(this->baudRate(), &bytes[4]);
+
+    if(!transact(ChangeBaudRate, bytes, 8).isValid()){
+        return false;
+    }
+
+    // The stub switches right after its ack, give it time before talking again
+    setBaudRate(baudRate);
+    m_trace.mark(QString("baud %1").arg(baudRate));
+    QThread::msleep(50);
+    clear(QSerialPort::Input);
+    m_decoder.reset();
+    m_rtt.clear();
+
+    return true;
+}
+
+bool ESPRom::verifyLink()
+{
+    char bytes[4];
+    quint32toBytes(ESP_OTP_MAC0, bytes);
+
+    for(int i = 0; i < 16; i++){
+        if(!transact(ReadReg, bytes, 4).isValid()){
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool ESPRom::negotiateBaudRate(qint32 baudRate)
+{
+    QList<qint32> rates;
+    rates << baudRate << 921600 << 460800 << 230400;
+
+    for(int i = 0; i < rates.size(); i++){
+        if(rates.at(i) > baudRate || (i > 0 && rates.at(i) == baudRate)){
+            continue;
+        }
+
+        if(!changeBaudRate(rates.at(i))){
+            return false;
+        }
+
+        if(verifyLink()){
+            emit message(QString("Baud rate changed to %1").arg(rates.at(i)));
+            return true;
+        }
+
+        // Step back down while the device still understands us
+        emit message(QString("Link unstable at %1 baud").arg(rates.at(i)));
+        if(!changeBaudRate(ESP_ROM_BAUD) || !verifyLink()){
+            return false;
+        }
+    }
+
+    return true;
+}
+
 bool ESPRom::run(bool reboot)
 {
     bool ret = false;
@@ -522,6 +1330,37 @@ quint32 ESPRom::flashID()
 }
 
 QByteArray ESPRom::flashRead(quint32 offset, quint32 size, quint32 count)
+{
+    QByteArray data;
+    if(!sflashRead(offset, size, count, [&data](const QByteArray &block){ data += block; return true; })){
+        return QByteArray();
+    }
+
+    return data;
+}
+
+bool ESPRom::flashRead(quint32 offset, quint32 size, QIODevice *sink)
+{
+    if(size == 0){
+        return true;
+    }
+
+    if(m_stubRunning){
+        return streamFlash(offset, size, sink);
+    }
+
+    // The sflash stub only sends whole blocks, the last one is cut to size
+    quint32 left = size;
+    return sflashRead(offset, ESP_FLASH_BLOCK, Tools::divRoundup(size, ESP_FLASH_BLOCK),
+                      [sink, &left](const QByteArray &block){
+        int length = qMin<quint32>(block.size(), left);
+        left -= length;
+        return sink->write(block.constData(), length) == length;
+    });
+}
+
+bool ESPRom::sflashRead(quint32 offset, quint32 size, quint32 count,
+                        const std::function<bool (const QByteArray &)> &sink)
 {
     char bytes[12];
     quint32toBytes(offset, &bytes[0]);
@@ -534,37 +1373,127 @@ QByteArray ESPRom::flashRead(quint32 offset, quint32 size, quint32 count)
 
     if(!flashBegin(0, 0) ||
             !memBegin(stub.size(), 1, stub.size(), 0x40100000) ||
-            !memBlock(stub, 0) ||
-            !memFinish(0x4010001c)){
-        return QByteArray();
+            !memBlock(stub, 0)){
+        return false;
     }
 
-    int tries = 10;
-    while(!waitForReadyRead(m_waitTimeout) && tries > 0){
-        tries--;
-    }
+    quint32 received = 0;
+    bool invalid = false;
+    int progress = -1;
+
+    // Installed before MEM_END: the stub streams right after acking it
+    m_frameHandler = [&](const QByteArray &frame){
+        if(invalid || received == count){
+            return;
+        }
+        if(frame.size() != (int)size || !sink(frame)){
+            invalid = true;
+            return;
+        }
+        received++;
+        if((int)(100 * received / count) != progress){
+            progress = 100 * received / count;
+            emit readProgress(progress);
+        }
+    };
+
+    bool started = memFinish(0x4010001c);
 
     emit commandStarted();
 
-    QByteArray data;
-    for(int i = 0; i < (int)count; i++){
-        if(readBytes(1) != QByteArray("\xc0", 1)){
-            emit commandError("Invalid head of packet (sflash read)");
-            return QByteArray();
+    // The stub needs a moment to start, so the first frame gets more time
+    bool ok = started && waitFor([&]{ return invalid || received == count; }, 10 * m_waitTimeout);
+    m_frameHandler = nullptr;
+
+    if(!started){
+        return false;
+    }
+
+    if(!ok || invalid){
+        emit commandError(invalid ? "Invalid end of packet (sflash read)" : "Invalid head of packet (sflash read)");
+        return false;
+    }
+
+    emit commandFinished();
+
+    return true;
+}
+
+void ESPRom::writeFrame(const char *data, int size)
+{
+    m_encoder.begin();
+    m_encoder.append(data, size);
+    m_encoder.end();
+
+    m_trace.record(TraceRecord::Sent, m_encoder.constData(), m_encoder.size());
+    write(m_encoder.constData(), m_encoder.size());
+}
+
+bool ESPRom::streamFlash(quint32 offset, quint32 size, QIODevice *sink, quint32 blockSize, quint32 window)
+{
+    char bytes[16];
+    quint32toBytes(offset, &bytes[0]);
+    quint32toBytes(size, &bytes[4]);
+    quint32toBytes(blockSize, &bytes[8]);
+    quint32toBytes(window, &bytes[12]);
+
+    QCryptographicHash md5(QCryptographicHash::Md5);
+    QByteArray digest;
+    quint32 received = 0;
+    bool failed = false, done = false;
+    int progress = -1;
+
+    // The stub sends up to window blocks ahead and waits for the running
+    // total to be acked, then closes the stream with the MD5 of the range.
+    m_frameHandler = [&](const QByteArray &frame){
+        if(failed || done){
+            return;
         }
 
-        data += readAndEscape(size);
-        emit flashReadProgress((100 * (i+1))/(float)count);
+        if(received == size){
+            digest = frame;
+            done = true;
+            return;
+        }
 
-        if(readBytes(1) != QByteArray("\xc0", 1)){
-            emit commandError("Invalid end of packet (sflash read)");
-            return QByteArray();
+        if((quint32)frame.size() != qMin(blockSize, size - received)
+                || sink->write(frame) != frame.size()){
+            failed = true;
+            return;
         }
+
+        md5.addData(frame);
+        received += frame.size();
+
+        char ack[4];
+        quint32toBytes(received, ack);
+        writeFrame(ack, 4);
+
+        if((int)(100 * (quint64)received / size) != progress){
+            progress = 100 * (quint64)received / size;
+            emit readProgress(progress);
+        }
+    };
+
+    bool ok = sendCommand(ReadFlash, bytes, 16).isValid()
+            && waitFor([&]{ return failed || done; }, 10 * m_waitTimeout);
+    m_frameHandler = nullptr;
+
+    if(!ok || failed){
+        // The stub may still be sending, drop whatever is left of the stream
+        QThread::msleep(100);
+        clear(QSerialPort::Input);
+        m_decoder.reset();
+        emit commandError(failed ? "Invalid data block (flash read)" : "Timed out reading Flash");
+        return false;
     }
 
-    emit commandFinished();
+    if(digest != md5.result()){
+        emit commandError("Flash read digest mismatch");
+        return false;
+    }
 
-    return data;
+    return true;
 }
 
 bool  ESPRom::flashUnlockDIO()
@@ -577,6 +1506,57 @@ bool  ESPRom::flashUnlockDIO()
     return ret;
 }
 
+bool ESPRom::eraseRegion(quint32 offset, quint32 size)
+{
+    QList<EraseOp> ops = ErasePlanner::plan(offset, size);
+    if(ops.isEmpty()){
+        return true;
+    }
+
+    if(m_flashPending > 0){
+        flashFlush();
+    }
+
+    // The ROM only erases through FLASH_BEGIN, as one range
+    if(!m_stubRunning){
+        quint32 start = ops.first().offset;
+        quint32 length = ops.last().offset + ops.last().size - start;
+
+        char bytes[16];
+        quint32toBytes(ErasePlanner::romEraseSize(start, length), &bytes[0]);
+        quint32toBytes(0, &bytes[4]);
+        quint32toBytes(flashBlockSize(), &bytes[8]);
+        quint32toBytes(start, &bytes[12]);
+
+        qint64 started = m_clock.elapsed();
+        if(!sendCommand(FlashBegin, bytes, 16, 0, 0, 0, eraseTimeout(ops)).isValid()){
+            emit commandError("Failed to erase Flash region");
+            return false;
+        }
+        updateEraseScale(ops, m_clock.elapsed() - started);
+
+        return true;
+    }
+
+    for(int i = 0; i < ops.size(); i++){
+        char bytes[8];
+        quint32toBytes(ops.at(i).offset, &bytes[0]);
+        quint32toBytes(ops.at(i).size, &bytes[4]);
+
+        QList<EraseOp> op;
+        op << ops.at(i);
+
+        qint64 started = m_clock.elapsed();
+        if(!sendCommand(EraseRegion, bytes, 8, 0, 0, 0, eraseTimeout(op)).isValid()){
+            emit commandError(QString::asprintf("Failed to erase Flash region at 0x%08X", ops.at(i).offset));
+            return false;
+        }
+        updateEraseScale(op, m_clock.elapsed() - started);
+    }
+
+    return true;
+}
+
 bool ESPRom::flashErase()
 {
     bool ret = false;
@@ -9,26 +9,48 @@
 #include <QSerialPort>
 #include <QByteArray>
 #include <QDataStream>
+#include <QQueue>
+#include <QHash>
+#include <QElapsedTimer>
+
+#include <functional>
+
+#include "slipcodec.h"
+#include "protocoltrace.h"
+#include "commandstats.h"
+#include "tools.h"
+
+class QTimer;
 
 namespace ESPFlasher {
 
+// READ_REG requests queued ahead of their responses, sized for the ROM's UART FIFO
+#define ESP_READ_REG_WINDOW     8
+
+// Floor of the adaptive command timeouts, in milliseconds
+#define ESP_MIN_TIMEOUT         50
+
+struct EraseOp;
+
 class CommandResponse {
 public:
     enum ResponseError{
         ResponseOK = 0x0,
         InvalidResponse = 0x1,
         InvalidPacketHead = 0x2,
-        InvalidPacketEnd = 0x3
-
+        InvalidPacketEnd = 0x3,
+        Timeout = 0x4,
+        Cancelled = 0x5
     };
 
-    CommandResponse(ResponseError error = ResponseOK){ m_error = error; }
+    CommandResponse(ResponseError error = ResponseOK): cmd(0), size(0), value(0) { m_error = error; }
 
-    bool isValid() {
-        return error() == ResponseOK && body == QByteArray("\x00\x00", 2);
+    // The status bytes close the body, some stub commands return data before them
+    bool isValid() const {
+        return error() == ResponseOK && body.endsWith(QByteArray("\x00\x00", 2));
     }
 
-    ResponseError error(){ return m_error; }
+    ResponseError error() const { return m_error; }
     void setError(ResponseError error) { m_error = error;}
 
     quint8 cmd;
@@ -42,6 +64,8 @@ private:
 
 };
 
+typedef std::function<void (const CommandResponse &response)> ResponseCallback;
+
 
 
 class ESPRom : public QSerialPort
@@ -71,24 +95,68 @@ public:
         MemData = 0x07,
         Sync = 0x08,
         WriteReg = 0x09,
-        ReadReg = 0x0a
+        ReadReg = 0x0a,
+        ChangeBaudRate = 0x0f,
+        FlashDeflBegin = 0x10,
+        FlashDeflData = 0x11,
+        FlashDeflEnd = 0x12,
+        SpiFlashMD5 = 0x13,
+        EraseRegion = 0xd1,
+        ReadFlash = 0xd2
     };
 
-    void setSerialPort(const QString &portName, const QSerialPort::BaudRate baudRate = QSerialPort::Baud115200){
+    // The link is brought up at the ROM baud rate first when a flasher stub
+    // is set, then switched to the requested rate by the stub.
+    void setSerialPort(const QString &portName, qint32 baudRate = QSerialPort::Baud115200){
+        if(portName != this->portName()){
+            m_stats.clear();
+        }
         setPortName(portName);
         setBaudRate(baudRate);
+        m_targetBaudRate = baudRate;
     }
 
     void setResetMode(int resetMode) { m_resetMode = resetMode; }
-
-    CommandResponse sendCommand(ESPCommand cmd, const char *data, quint16 size, quint32 chk = 0);
-    CommandResponse sendCommand(ESPCommand cmd = NoCommand, const QByteArray &data = QByteArray(), quint32 chk = 0);
-    CommandResponse receiveResponse();
+    void setStubFile(const QString &filename) { m_stubFile = filename; }
+    bool isStubRunning() const { return m_stubRunning; }
+    quint32 flashBlockSize() const;
+
+    // Number of FLASH_DATA blocks allowed on the wire before waiting for an ack.
+    void setFlashWindow(int window) { m_flashWindow = qMax(1, window); }
+    int flashWindow() const { return m_flashWindow; }
+
+    // Records every frame on the link to fileName, an empty name stops recording
+    bool setTraceFile(const QString &fileName);
+
+    // Command counters since the port was set, and since the last resetSessionStats()
+    const CommandStats &stats() const { return m_stats; }
+    const CommandStats &sessionStats() const { return m_sessionStats; }
+    void resetSessionStats() { m_sessionStats.clear(); }
+    QJsonObject statistics(bool session = true) const;
+    quint32 flashAckedBlocks() const { return m_flashAcked; }
+
+    // Non-blocking interface: the command is queued, sent as soon as the link
+    // allows it and the callback is invoked with its response or a timeout.
+    quint32 enqueueCommand(ESPCommand cmd, const QByteArray &data, quint32 chk = 0,
+                           const ResponseCallback &callback = ResponseCallback(), int timeout = -1);
+    quint32 enqueueCommand(ESPCommand cmd, const QByteArray &params, const QByteArray &payload, quint32 chk,
+                           const ResponseCallback &callback, int timeout = -1);
+    void cancelCommands();
+    bool hasPendingCommands() const { return !m_commandQueue.isEmpty() || !m_inFlight.isEmpty(); }
+
+    // Blocking interface, driving the same engine until the command completes
+    CommandResponse sendCommand(ESPCommand cmd, const char *data, quint16 size, quint32 chk = 0,
+                                const char *payload = 0, quint16 payloadSize = 0, int timeout = -1);
+    CommandResponse sendCommand(ESPCommand cmd, const QByteArray &data = QByteArray(), quint32 chk = 0);
+    bool waitFor(const std::function<bool ()> &done, int idleTimeout = -1);
 
     bool openPort();
     bool isPortOpen() const { return isOpen() && m_isSync; }
     void closePort();
 
+    bool runStub();
+    bool changeBaudRate(qint32 baudRate);
+
     QString macAddress() {
         if(m_macAddress.isEmpty())
             m_macAddress = readMAC().toHex();
@@ -109,23 +177,42 @@ public:
     }
 
     quint32 readReg(quint32 addr);
+    // Word by word, with up to ESP_READ_REG_WINDOW reads on the wire
+    bool readMemory(quint32 addr, quint32 size, QIODevice *sink);
     bool writeReg(quint32 addr, quint32 value, quint32 mask, quint32 delayus = 0);
 
     bool memBegin(quint32 size, quint32 blocks, quint32 blocksize, quint32 offset);
     bool memBlock(const QByteArray &data, quint32 seq);
     bool memFinish(quint32 entrypoint = 0);
 
-    bool flashBegin(quint32 size, quint32 offset);
+    // With erase false the range must have been erased by eraseRegion(), the
+    // stub always erases as it writes and ignores it
+    bool flashBegin(quint32 size, quint32 offset, bool erase = true);
     bool flashBlock(const QByteArray &data, quint32 seq);
+    // With the checksum of a prepared block
+    bool flashBlock(const QByteArray &data, quint32 seq, quint8 checksum);
+    bool flashFlush();
     bool flashFinish(bool reboot = false);
 
+    // Compressed writes, inflated on the target by the flasher stub
+    bool flashDeflBegin(quint32 size, quint32 compressedSize, quint32 offset);
+    bool flashDeflBlock(const QByteArray &data, quint32 seq);
+    bool flashDeflBlock(const QByteArray &data, quint32 seq, quint8 checksum);
+    bool flashDeflFinish(bool reboot = false);
+
+    // MD5 of each sector in the range, computed on the target by the stub
+    QList<QByteArray> flashDigests(quint32 offset, quint32 size, quint32 sectorSize = ESP_FLASH_SECTOR);
+
     bool run(bool reboot = false);
     QByteArray readMAC();
     quint32 flashID();
     QByteArray flashRead(quint32 offset, quint32 size, quint32 count = 1);
+    // Streams the range to the sink block by block, memory use does not grow with size
+    bool flashRead(quint32 offset, quint32 size, QIODevice *sink);
 
     bool flashUnlockDIO();
     bool flashErase();
+    bool eraseRegion(quint32 offset, quint32 size);
 
 protected:
     virtual qint64	readData(char * data, qint64 maxSize);
@@ -135,25 +222,104 @@ signals:
     void commandStarted(ESPCommand cmd = NoCommand);
     void commandFinished(ESPCommand cmd = NoCommand);
     void commandError(const QString &errorText);
-    void flashReadProgress(int progress);
+    void readProgress(int progress);
+    void message(const QString &text);
 
 private slots:
     void handleSerialError(QSerialPort::SerialPortError error);
+    void onReadyRead();
+    void onBytesWritten(qint64 bytes);
+    void expireCommands();
 
 private:
+    struct PendingCommand {
+        quint32 id;
+        ESPCommand cmd;
+        QByteArray params;
+        QByteArray payload;
+        quint32 chk;
+        int timeout;
+        qint64 deadline;
+        qint64 sentAt;
+        qint64 writtenAt;   // us, for the statistics
+        bool adaptive;
+        ResponseCallback callback;
+    };
+
+    // Smoothed round trip time and its variation, as in RFC 6298
+    struct RttEstimate {
+        qint64 srtt;
+        qint64 rttvar;
+    };
+
+    void init();
+    bool connectDevice(qint32 baudRate);
+    bool reconnectRom(qint32 baudRate);
     void resetDevice(int mode = Auto);
+    int waitForBoot(int timeout);
     bool sync();
-    QByteArray readAndEscape(int size = 1);
-    QByteArray readBytes(int size = 1);
-    void writeToPort(QByteArray data);
+    QString adapterKey() const;
+    QList<int> resetModes(const QString &adapter, int *bootTime) const;
+    void saveResetProfile(const QString &adapter, int mode, int bootTime) const;
+    bool verifyLink();
+    bool negotiateBaudRate(qint32 baudRate);
+    CommandResponse transact(ESPCommand cmd, const char *data, quint16 size, quint32 chk = 0,
+                             const char *payload = 0, quint16 payloadSize = 0, int timeout = -1);
+    void pumpQueue();
+    void writeCommand(const PendingCommand &command);
+    void completeCommand(const CommandResponse &response);
+    void scheduleTimeout();
+    // Counts a reply still due to an expired command, to be dropped
+    void expectLateResponse(ESPCommand cmd);
+    bool queueFlashBlock(ESPCommand cmd, const QByteArray &data, quint32 seq, quint8 checksum, int timeout = -1);
+    void writeFrame(const char *data, int size);
+    bool sflashRead(quint32 offset, quint32 size, quint32 count, const std::function<bool (const QByteArray &)> &sink);
+    bool streamFlash(quint32 offset, quint32 size, QIODevice *sink, quint32 blockSize = ESP_FLASH_SECTOR, quint32 window = 64);
+    int commandTimeout(ESPCommand cmd) const;
+    int eraseTimeout(const QList<EraseOp> &ops) const;
+    void updateRtt(ESPCommand cmd, qint64 rtt);
+    void updateEraseScale(const QList<EraseOp> &ops, qint64 elapsed);
+    static bool isIdempotent(ESPCommand cmd) { return cmd == ReadReg || cmd == WriteReg || cmd == SpiFlashMD5; }
+    static bool isPipelined(ESPCommand cmd) {
+        return cmd == FlashData || cmd == FlashDeflData || cmd == SpiFlashMD5 || cmd == ReadReg;
+    }
+    int windowFor(ESPCommand cmd) const { return cmd == ReadReg ? ESP_READ_REG_WINDOW : m_flashWindow; }
+    static CommandResponse parseResponse(const QByteArray &frame);
     QString errorText(CommandResponse response);
 
 private:
     QString m_macAddress;
     int m_waitTimeout;
+    int m_syncTimeout;
     bool m_isSync;
     quint32 m_flashID;
     int m_resetMode;
+    qint32 m_targetBaudRate;
+    QString m_stubFile;
+    bool m_stubRunning;
+    int m_flashWindow;
+    quint32 m_flashAcked;
+    int m_flashPending;
+    bool m_flashFailed;
+    int m_deflBlockTimeout;
+    SlipEncoder m_encoder;
+    SlipDecoder m_decoder;
+
+    quint32 m_nextCommandId;
+    QQueue<PendingCommand> m_commandQueue;
+    QQueue<PendingCommand> m_inFlight;
+    QTimer *m_timeoutTimer;
+    QElapsedTimer m_clock;
+    qint64 m_rxCount;
+    quint8 m_lateCmd;
+    int m_lateResponses;
+    qint64 m_lateUntil;
+    std::function<void (const QByteArray &frame)> m_frameHandler;
+    QHash<int, RttEstimate> m_rtt;
+    double m_eraseScale;
+    TraceWriter m_trace;
+    CommandStats m_stats;
+    CommandStats m_sessionStats;
 };
 
 } //namespace ESPFlasher
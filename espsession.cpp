@@ -0,0 +1,747 @@
+#include "espsession.h"
+#include "esprom.h"
+#include "espfirmwareimage.h"
+#include "flasherstub.h"
+#include "eraseplanner.h"
+#include "flashjob.h"
+#include "preparedimagecache.h"
+#include "constants.h"
+#include "tools.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QBuffer>
+#include <QDir>
+#include <QDateTime>
+#include <QSettings>
+#include <QCryptographicHash>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+namespace ESPFlasher {
+
+ESPSession::ESPSession(QObject *parent) :
+    QObject(parent),
+    m_esp(new ESPRom(this))
+{
+    connect(m_esp, SIGNAL(commandError(QString)), this, SIGNAL(error(QString)));
+    connect(m_esp, SIGNAL(message(QString)), this, SLOT(romMessage(QString)));
+    connect(m_esp, SIGNAL(readProgress(int)), this, SLOT(romReadProgress(int)));
+}
+
+ESPSession::~ESPSession()
+{
+}
+
+bool ESPSession::isReady()
+{
+    if(!m_esp->isPortOpen()){
+        emit logMessage(tr("Not connected to ESP8266."), Warning);
+        emit finished(false);
+        return false;
+    }
+
+    emit started();
+    return true;
+}
+
+void ESPSession::romMessage(const QString &text)
+{
+    emit logMessage(text);
+}
+
+void ESPSession::romReadProgress(int progress)
+{
+    emit logMessage(QString::asprintf("Reading... (%d %%)", progress), Info, 1);
+}
+
+void ESPSession::open(const QString &portName, int baudRate, int resetMode)
+{
+    if(!m_esp->isPortOpen()){
+        QSettings settings;
+        QString stubFile = settings.value("stubFile", FlasherStub::defaultFilename()).toString();
+
+        m_esp->setSerialPort(portName, baudRate);
+        m_esp->setResetMode(resetMode);
+        m_esp->setStubFile(QFileInfo(stubFile).isFile() ? stubFile : QString());
+
+        QString traceDir = settings.value("traceDir", "").toString();
+        if(!traceDir.isEmpty()){
+            QString traceFile = QDir(traceDir).filePath(QString("%1-%2.esptrace")
+                                                        .arg(QFileInfo(portName).fileName())
+                                                        .arg(QDateTime::currentDateTime().toString("yyyyMMdd-hhmmss")));
+            if(m_esp->setTraceFile(traceFile)){
+                emit logMessage(QString("Recording protocol trace to %1").arg(traceFile));
+            } else {
+                emit logMessage(QString("Could not create protocol trace %1").arg(traceFile), Warning);
+            }
+        }
+
+        m_esp->openPort();
+    }
+
+    bool ok = m_esp->isPortOpen();
+    emit opened(ok, ok ? m_esp->macAddress() : QString(), m_esp->portName());
+}
+
+void ESPSession::close()
+{
+    m_esp->closePort();
+    m_esp->setTraceFile(QString());
+    emit closed();
+}
+
+QList<FlashImage> ESPSession::prepareImages(const QList<FlashFile> &files, int flashMode, int flashSizeFreq)
+{
+    QList<FlashImage> images;
+    for(int i = 0; i < files.size(); i++)
+    {
+        FlashImage image;
+        if(PreparedImageCache::instance()->image(files.at(i), flashMode, flashSizeFreq, &image)){
+            images.append(image);
+        }
+    }
+
+    return images;
+}
+
+void ESPSession::writeFlash(const QList<FlashFile> &files, int flashMode, int flashSizeFreq, int flashWindow,
+                            bool compress, bool diff)
+{
+    writeImages(prepareImages(files, flashMode, flashSizeFreq), flashMode, flashWindow, compress, diff);
+}
+
+void ESPSession::writeImages(const QList<FlashImage> &images, int flashMode, int flashWindow,
+                             bool compress, bool diff)
+{
+    if(!isReady()){
+        return;
+    }
+
+    m_esp->resetSessionStats();
+    finishWrite(writeAll(images, flashMode, flashWindow, compress, diff));
+}
+
+void ESPSession::writeJob(const FlashJob &job, quint32 serial, int flashWindow)
+{
+    if(!isReady()){
+        return;
+    }
+
+    m_esp->resetSessionStats();
+
+    QByteArray macAddress = QByteArray::fromHex(m_esp->macAddress().toLatin1());
+    if(job.usesMacAddress() && macAddress.size() != 6){
+        emit logMessage(QString("Could not read the MAC address the job '%1' writes").arg(job.name()), Error);
+        finishWrite(false);
+        return;
+    }
+
+    // The sectors around patches outside of the images keep their content
+    QList<FlashImage> sectors;
+    foreach(quint32 offset, job.patchSectors()){
+        QBuffer buffer;
+        buffer.open(QIODevice::WriteOnly);
+        if(!m_esp->flashRead(offset, ESP_FLASH_SECTOR, &buffer) || buffer.size() != ESP_FLASH_SECTOR){
+            emit logMessage(QString::asprintf("Could not read the Flash sector at 0x%08X", offset), Error);
+            finishWrite(false);
+            return;
+        }
+
+        FlashImage sector;
+        sector.index = -1;
+        sector.name = QString::asprintf("0x%05x", offset);
+        sector.offset = offset;
+        sector.data = buffer.data();
+        sectors.append(sector);
+    }
+
+    QList<FlashImage> images = job.imagesFor(macAddress, serial, sectors);
+    if(job.usesSerial()){
+        emit logMessage(QString("Job '%1', device serial %2").arg(job.name()).arg(serial));
+    }
+
+    bool ok = writeAll(images, job.flashMode(), flashWindow, job.compress(), job.diff());
+    if(ok && job.verify() != FlashJob::VerifyNone){
+        ok = verifyImages(images, job.verify() == FlashJob::VerifyReadback);
+    }
+
+    finishWrite(ok);
+}
+
+bool ESPSession::writeAll(const QList<FlashImage> &images, int flashMode, int flashWindow,
+                          bool compress, bool diff)
+{
+    m_esp->setFlashWindow(flashWindow);
+
+    // Deflated blocks are inflated by the stub, the ROM only takes raw blocks
+    bool deflate = compress && m_esp->isStubRunning();
+
+    if(diff && !m_esp->isStubRunning()){
+        emit logMessage("Differential flashing needs the flasher stub, writing whole images", Warning);
+        diff = false;
+    }
+
+    int totalWritten = 0;
+    for(int i = 0; i < images.size(); i++)
+    {
+        // Shared with other sessions, only detached when padding is needed
+        QByteArray image = images.at(i).data;
+        quint32 address = images.at(i).offset;
+        int index = images.at(i).index;
+
+        // Nothing to erase or send, and no progress to divide
+        if(image.isEmpty()){
+            emit logMessage(QString::asprintf("'%s' is empty, skipped", images.at(i).name.toLatin1().data()), Warning);
+            emit fileProgress(index, 100);
+            continue;
+        }
+
+        emit fileProgress(index, 0);
+
+        if(deflate){
+            while(image.size() % 4){
+                image.append("\xff", 1);
+            }
+        }
+
+        QList<FlashRange> ranges;
+        if(diff){
+            ranges = changedRanges(image, address);
+        } else {
+            ranges << FlashRange(0, image.size());
+        }
+
+        QString name = images.at(i).name;
+        if(ranges.isEmpty()){
+            emit logMessage(QString::asprintf("'%s' is unchanged at 0x%08X, skipped", name.toLatin1().data(), address));
+            emit fileProgress(index, 100);
+            continue;
+        }
+
+        int total = 0, done = 0, row = 0, written = 0;
+        for(int j = 0; j < ranges.size(); j++){
+            total += ranges.at(j).second;
+        }
+
+        for(int j = 0; j < ranges.size(); j++){
+            quint32 offset = ranges.at(j).first, size = ranges.at(j).second;
+            // Prepared blocks are only reused for whole images
+            QString cacheKey = size == (quint32)image.size() ? images.at(i).cacheKey : QString();
+            if(!writeResumable(image.mid(offset, size), address + offset, deflate,
+                               name, cacheKey, index, done, total, row, written)){
+                return false;
+            }
+        }
+
+        if(diff){
+            emit logMessage(QString::asprintf("Wrote %d of %d bytes at 0x%08X, %d range(s) changed",
+                                              total, image.size(), address, ranges.size()), Info, row);
+        } else if(deflate){
+            emit logMessage(QString::asprintf("Wrote %d bytes (%d compressed) at 0x%08X",  image.size(), written, address), Info, row);
+        } else {
+            emit logMessage(QString::asprintf("Wrote %d bytes at 0x%08X",  written, address), Info, row);
+        }
+        totalWritten += (deflate || diff) ? total : written;
+    }
+
+    if(deflate && !m_esp->flashDeflFinish(false)){
+        return false;
+    }
+
+    if(flashMode == DIO){
+        m_esp->flashUnlockDIO();
+    }
+
+    emit flashWritten(totalWritten);
+    return true;
+}
+
+bool ESPSession::verifyImages(const QList<FlashImage> &images, bool readback)
+{
+    // Digests are computed by the stub, the ROM can only read everything back
+    if(!readback && !m_esp->isStubRunning()){
+        emit logMessage("Digest verification needs the flasher stub, reading images back", Warning);
+        readback = true;
+    }
+
+    for(int i = 0; i < images.size(); i++){
+        const FlashImage &image = images.at(i);
+        emit logMessage(QString::asprintf("Verifying '%s' at 0x%08X...", image.name.toLatin1().data(), image.offset));
+
+        int bad = -1;
+        if(readback){
+            QBuffer buffer;
+            buffer.open(QIODevice::WriteOnly);
+            if(!m_esp->flashRead(image.offset, image.data.size(), &buffer)){
+                return false;
+            }
+            const QByteArray &flash = buffer.data();
+            for(int offset = 0; offset < image.data.size() && bad < 0; offset += ESP_FLASH_SECTOR){
+                if(flash.mid(offset, ESP_FLASH_SECTOR) != image.data.mid(offset, ESP_FLASH_SECTOR)){
+                    bad = offset;
+                }
+            }
+        } else {
+            QList<QByteArray> digests = m_esp->flashDigests(image.offset, image.data.size());
+            if(digests.isEmpty()){
+                emit logMessage("Could not read Flash digests", Error);
+                return false;
+            }
+            for(int j = 0; j < digests.size() && bad < 0; j++){
+                QByteArray sector = image.data.mid(j * ESP_FLASH_SECTOR, ESP_FLASH_SECTOR);
+                if(QCryptographicHash::hash(sector, QCryptographicHash::Md5) != digests.at(j)){
+                    bad = j * ESP_FLASH_SECTOR;
+                }
+            }
+        }
+
+        if(bad >= 0){
+            emit logMessage(QString::asprintf("Verify failed at 0x%08X", image.offset + bad), Error, 1);
+            return false;
+        }
+        emit logMessage(QString::asprintf("Verifying '%s' at 0x%08X...done", image.name.toLatin1().data(), image.offset), Info, 1);
+    }
+
+    return true;
+}
+
+void ESPSession::finishWrite(bool ok)
+{
+    const CommandStats &stats = m_esp->sessionStats();
+    CommandCounters data = stats.counters(ESPRom::FlashDeflData);
+    CommandCounters begin = stats.counters(ESPRom::FlashDeflBegin);
+    if(!data.sent){
+        data = stats.counters(ESPRom::FlashData);
+        begin = stats.counters(ESPRom::FlashBegin);
+    }
+    quint64 timeouts = 0, retries = 0;
+    foreach(int cmd, stats.commands()){
+        timeouts += stats.counters(cmd).timeouts;
+        retries += stats.counters(cmd).retries;
+    }
+
+    emit logMessage(QString::asprintf("%.1f KB/s over %.1f s, blocks p50 %.1f ms p99 %.1f ms, begin max %.1f ms, %llu timeouts, %llu retries",
+                                      stats.bytesSent() / 1024.0 / qMax<qint64>(stats.elapsed(), 1) * 1000,
+                                      stats.elapsed() / 1000.0,
+                                      data.latency.percentile(0.5) / 1000.0, data.latency.percentile(0.99) / 1000.0,
+                                      begin.latency.max() / 1000.0, timeouts, retries));
+
+    QSettings settings;
+    QString statsDir = settings.value("statsDir", "").toString();
+    if(!statsDir.isEmpty()){
+        QJsonObject json = m_esp->statistics(true);
+        json["ok"] = ok;
+        json["port_total"] = m_esp->statistics(false);
+
+        QFile file(QDir(statsDir).filePath(QString("%1-%2.json")
+                                           .arg(QFileInfo(m_esp->portName()).fileName())
+                                           .arg(QDateTime::currentDateTime().toString("yyyyMMdd-hhmmss"))));
+        if(!file.open(QIODevice::WriteOnly) || file.write(QJsonDocument(json).toJson()) < 0){
+            emit logMessage(QString("Could not write statistics to %1").arg(file.fileName()), Warning);
+        }
+    }
+
+    emit finished(ok);
+}
+
+QList<ESPSession::FlashRange> ESPSession::changedRanges(const QByteArray &image, quint32 address)
+{
+    QList<FlashRange> ranges;
+
+    // Sectors of an unaligned image straddle two flash sectors, erasing a
+    // changed one would wipe part of an unchanged neighbour
+    if(address % ESP_FLASH_SECTOR){
+        emit logMessage(QString::asprintf("0x%08X is not sector aligned, writing whole image", address), Warning);
+        ranges << FlashRange(0, image.size());
+        return ranges;
+    }
+
+    QList<QByteArray> digests = m_esp->flashDigests(address, image.size());
+    if(digests.isEmpty()){
+        emit logMessage("Could not read Flash digests, writing whole image", Warning);
+        ranges << FlashRange(0, image.size());
+        return ranges;
+    }
+
+    // Adjacent changed sectors are merged so each run costs a single erase and begin
+    for(int i = 0; i < digests.size(); i++){
+        quint32 offset = i * ESP_FLASH_SECTOR;
+        quint32 size = qMin<quint32>(ESP_FLASH_SECTOR, image.size() - offset);
+        QByteArray local = QCryptographicHash::hash(image.mid(offset, size), QCryptographicHash::Md5);
+        if(local == digests.at(i)){
+            continue;
+        }
+
+        if(!ranges.isEmpty() && ranges.last().first + ranges.last().second == offset){
+            ranges.last().second += size;
+        } else {
+            ranges << FlashRange(offset, size);
+        }
+    }
+
+    return ranges;
+}
+
+bool ESPSession::writeResumable(const QByteArray &image, quint32 address, bool deflate, const QString &name,
+                                const QString &cacheKey, int index, int &done, int total, int &row, int &written)
+{
+    QSettings settings;
+    int retries = settings.value("flashRetries", 2).toInt();
+    PreparedBlocks prepared = PreparedImageCache::instance()->blocks(cacheKey, image, deflate, m_esp->flashBlockSize());
+    QByteArray digest = prepared.digest;
+
+    // An earlier run may have stopped inside this range on this very device,
+    // the flash may have changed since so only digests can tell what is left
+    quint32 resume = 0;
+    if(m_esp->isStubRunning()){
+        resume = resumeOffset(image, address, loadCheckpoint(address, digest));
+    }
+    int base = done;
+
+    for(int attempt = 0; ; attempt++){
+        if(resume > 0){
+            emit logMessage(QString::asprintf("Resuming '%s' at 0x%08X", name.toLatin1().data(), address + resume), Info, row++);
+        }
+
+        // Only resumed writes need their blocks prepared again
+        if(resume > 0 || prepared.blockSize != (int)m_esp->flashBlockSize()){
+            prepared = PreparedImageCache::instance()->blocks(resume ? QString() : cacheKey, image.mid(resume),
+                                                              deflate, m_esp->flashBlockSize());
+        }
+
+        quint32 acked = 0;
+        done = base + resume;
+        if(writeRange(image.mid(resume), address + resume, deflate, name, prepared,
+                      index, done, total, row, written, acked)){
+            clearCheckpoint(address);
+            return true;
+        }
+
+        saveCheckpoint(address, digest, resume + acked);
+        if(attempt >= retries || !reconnect(deflate)){
+            return false;
+        }
+
+        resume = resumeOffset(image, address, resume + acked);
+    }
+}
+
+quint32 ESPSession::resumeOffset(const QByteArray &image, quint32 address, quint32 checkpoint)
+{
+    // Erases are per flash sector, so a resumed write starts on a sector boundary.
+    // Sectors of an unaligned image straddle two flash sectors, it is rewritten whole
+    if(address % ESP_FLASH_SECTOR){
+        return 0;
+    }
+    quint32 resume = checkpoint - checkpoint % ESP_FLASH_SECTOR;
+    if(resume == 0 || !m_esp->isStubRunning()){
+        return resume;
+    }
+
+    // Check what already made it to flash, without reading it back
+    QList<QByteArray> digests = m_esp->flashDigests(address, resume);
+    if(digests.isEmpty()){
+        return 0;
+    }
+
+    for(int i = 0; i < digests.size(); i++){
+        QByteArray sector = image.mid(i * ESP_FLASH_SECTOR, ESP_FLASH_SECTOR);
+        if(QCryptographicHash::hash(sector, QCryptographicHash::Md5) != digests.at(i)){
+            return i * ESP_FLASH_SECTOR;
+        }
+    }
+
+    return resume;
+}
+
+bool ESPSession::reconnect(bool stub)
+{
+    emit logMessage("Reconnecting to resume the write...", Warning);
+
+    m_esp->closePort();
+    if(!m_esp->openPort() || (stub && !m_esp->isStubRunning())){
+        emit logMessage("Failed to reconnect to ESP8266", Error);
+        return false;
+    }
+
+    return true;
+}
+
+QString ESPSession::checkpointKey(quint32 address)
+{
+    // Without a MAC address devices cannot be told apart
+    if(m_esp->macAddress().isEmpty()){
+        return QString();
+    }
+    return QString("checkpoints/%1_%2").arg(m_esp->macAddress()).arg(address, 8, 16, QChar('0'));
+}
+
+quint32 ESPSession::loadCheckpoint(quint32 address, const QByteArray &digest)
+{
+    QSettings settings;
+    QString key = checkpointKey(address);
+    if(key.isEmpty() || settings.value(key + "/digest").toByteArray() != digest.toHex()){
+        return 0;
+    }
+
+    return settings.value(key + "/written", 0).toUInt();
+}
+
+void ESPSession::saveCheckpoint(quint32 address, const QByteArray &digest, quint32 written)
+{
+    QSettings settings;
+    QString key = checkpointKey(address);
+    if(key.isEmpty()){
+        return;
+    }
+    settings.setValue(key + "/digest", digest.toHex());
+    settings.setValue(key + "/written", written);
+}
+
+void ESPSession::clearCheckpoint(quint32 address)
+{
+    QString key = checkpointKey(address);
+    if(!key.isEmpty()){
+        QSettings settings;
+        settings.remove(key);
+    }
+}
+
+void ESPSession::clearCheckpoints()
+{
+    QString mac = m_esp->macAddress();
+    if(mac.isEmpty()){
+        return;
+    }
+
+    QSettings settings;
+    settings.beginGroup("checkpoints");
+    foreach(const QString &key, settings.childGroups()){
+        if(key.startsWith(mac + "_")){
+            settings.remove(key);
+        }
+    }
+    settings.endGroup();
+}
+
+bool ESPSession::writeRange(const QByteArray &image, quint32 address, bool deflate, const QString &name,
+                            const PreparedBlocks &prepared, int index, int &done, int total, int &row, int &written, quint32 &acked)
+{
+    int blockSize = prepared.blockSize;
+
+    // The stub erases on its own as blocks come in, ROM writes are erased as planned
+    bool ok;
+    if(deflate){
+        ok = m_esp->flashDeflBegin(image.size(), prepared.dataSize, address);
+    } else if(m_esp->isStubRunning()){
+        ok = m_esp->flashBegin(image.size(), address);
+    } else {
+        ok = m_esp->eraseRegion(address, image.size()) && m_esp->flashBegin(image.size(), address, false);
+    }
+    if(!ok){
+        emit logMessage("Failed to enter Flash download mode", Error);
+        return false;
+    }
+
+    // Compressed blocks only give an estimate of what the stub wrote
+    auto ackedBytes = [&]{
+        if(!prepared.dataSize){
+            return (quint32)0;
+        }
+        return (quint32)qMin<quint64>(image.size(), (quint64)m_esp->flashAckedBlocks() * blockSize * image.size() / prepared.dataSize);
+    };
+
+    int progress = -1;
+    for(int seq = 0; seq < prepared.blocks.size(); seq++)
+    {
+        // Only report when the percentage moves, the GUI repaints on each
+        int uncompressed = (quint64)image.size() * seq * blockSize / prepared.dataSize;
+        if(100 * (done + uncompressed) / total != progress){
+            progress = 100 * (done + uncompressed) / total;
+            emit logMessage(QString::asprintf(WRITE_FLASH_PROGRESS, name.toLatin1().data(),
+                                              address + uncompressed, progress), Info, row++);
+            emit fileProgress(index, progress);
+        }
+
+        const QByteArray &block = prepared.blocks.at(seq);
+        quint8 checksum = prepared.checksums.at(seq);
+        ok = deflate ? m_esp->flashDeflBlock(block, seq, checksum) : m_esp->flashBlock(block, seq, checksum);
+
+        if(!ok){
+            emit logMessage(QString("Failed to write to target Flash after seq %1").arg(m_esp->flashAckedBlocks()), Error);
+            acked = ackedBytes();
+            return false;
+        }
+
+        written += block.size();
+    }
+
+    if(!m_esp->flashFlush()){
+        emit logMessage(QString("Failed to write to target Flash after seq %1").arg(m_esp->flashAckedBlocks()), Error);
+        acked = ackedBytes();
+        return false;
+    }
+
+    done += image.size();
+    emit fileProgress(index, 100 * done / total);
+
+    return true;
+}
+
+void ESPSession::readFlash(const QString &filename, quint32 address, quint32 size)
+{
+    if(!isReady()){
+        return;
+    }
+
+    QFile file(filename);
+    if(!file.open(QIODevice::WriteOnly)){
+        emit logMessage(file.errorString(), Error);
+        emit finished(false);
+        return;
+    }
+
+    emit logMessage(QString::asprintf("Reading %d bytes at 0x%08X...",  size, address));
+    bool ok = m_esp->flashRead(address, size, &file);
+    if(ok){
+        emit logMessage(QString::asprintf("Reading %lld bytes at 0x%08X...done",  file.pos(), address), Info, 1);
+    }
+    file.close();
+
+    emit finished(ok);
+}
+
+void ESPSession::eraseFlash()
+{
+    if(!isReady()){
+        return;
+    }
+
+    bool ok = m_esp->flashErase();
+    clearCheckpoints();
+    if(ok){
+        emit logMessage("Flash content deleted.", Warning);
+    }
+
+    emit finished(ok);
+}
+
+void ESPSession::eraseRegion(quint32 address, quint32 size)
+{
+    if(!isReady()){
+        return;
+    }
+
+    QList<EraseOp> ops = ErasePlanner::plan(address, size);
+    int blocks = 0, sectors = 0;
+    for(int i = 0; i < ops.size(); i++){
+        if(ops.at(i).block)
+            blocks += ops.at(i).size / ESP_FLASH_ERASE_BLOCK;
+        else
+            sectors += ops.at(i).size / ESP_FLASH_SECTOR;
+    }
+
+    if(ops.isEmpty()){
+        emit finished(true);
+        return;
+    }
+
+    quint32 start = ops.first().offset, end = ops.last().offset + ops.last().size;
+    emit logMessage(QString::asprintf("Erasing 0x%08X-0x%08X: %d block(s), %d sector(s)...",
+                                      start, end - 1, blocks, sectors));
+
+    bool ok = m_esp->eraseRegion(address, size);
+    clearCheckpoints();
+    if(ok){
+        emit logMessage(QString::asprintf("Erased %d bytes at 0x%08X", end - start, start), Warning);
+    }
+
+    emit finished(ok);
+}
+
+void ESPSession::loadRam(const QString &filename)
+{
+    if(!isReady()){
+        return;
+    }
+
+    ESPFirmwareImage image(filename);
+
+    emit logMessage(tr("RAM boot..."));
+    for(int i = 0; i < image.segments().size(); i++){
+        Segment segment = image.segments().at(i);
+        emit logMessage(QString::asprintf("Downloading %d bytes at %08X...", segment.size, segment.offset), Info, i);
+        m_esp->memBegin(segment.size, Tools::divRoundup(segment.size, ESP_RAM_BLOCK), ESP_RAM_BLOCK, segment.offset);
+        int seq = 0, pos = 0;
+        while(pos < segment.data.size()){
+            m_esp->memBlock(segment.data.mid(pos, ESP_RAM_BLOCK), seq);
+            pos += ESP_RAM_BLOCK;
+            seq++;
+        }
+    }
+    emit logMessage(QString::asprintf("All segments done, executing at %08X", image.entryPoint()));
+
+    emit finished(m_esp->memFinish(image.entryPoint()));
+}
+
+void ESPSession::dumpMemory(const QString &filename, quint32 address, quint32 size)
+{
+    if(!isReady()){
+        return;
+    }
+
+    QFile file(filename);
+    if(!file.open(QIODevice::WriteOnly)){
+        emit logMessage(file.errorString(), Error);
+        emit finished(false);
+        return;
+    }
+
+    emit logMessage(QString::asprintf("Reading %d bytes at 0x%08X...",  size, address));
+    bool ok = m_esp->readMemory(address, size, &file);
+    if(ok){
+        emit logMessage(QString::asprintf("Reading %lld bytes at 0x%08X...done",  file.pos(), address), Info, 1);
+    }
+    file.close();
+
+    emit finished(ok);
+}
+
+void ESPSession::readMemory(quint32 address)
+{
+    if(!isReady()){
+        return;
+    }
+
+    quint32 value = m_esp->readReg(address);
+    emit logMessage(QString::asprintf("0x%08X = 0x%08X", address, value));
+
+    emit finished(true);
+}
+
+void ESPSession::writeMemory(quint32 address, quint32 value, quint32 mask)
+{
+    if(!isReady()){
+        return;
+    }
+
+    bool ok = m_esp->writeReg(address, value, mask, 0);
+    emit logMessage(QString::asprintf("Wrote 0x%08X, mask 0x%08X to 0x%08X", value, mask, address));
+
+    emit finished(ok);
+}
+
+void ESPSession::run()
+{
+    if(!isReady()){
+        return;
+    }
+
+    bool ok = m_esp->run();
+    emit logMessage("Image is running on device...");
+
+    emit finished(ok);
+}
+
+} //namespace ESPFlasher
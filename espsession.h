@@ -0,0 +1,130 @@
+#ifndef ESPSESSION_H
+#define ESPSESSION_H
+
+#include <QObject>
+#include <QList>
+#include <QPair>
+#include <QMetaType>
+
+namespace ESPFlasher {
+
+class ESPRom;
+class FlashJob;
+struct PreparedBlocks;
+
+struct FlashFile {
+    int index;
+    QString filename;
+    quint32 offset;
+};
+
+// A file read and patched for the target, ready to be written
+struct FlashImage {
+    int index;
+    QString name;
+    quint32 offset;
+    QByteArray data;
+    QString cacheKey;   // identifies unmodified data in the PreparedImageCache, empty otherwise
+};
+
+/*
+ * A device session owns an ESPRom and runs whole operations on it. It is
+ * meant to live in its own thread: slots are invoked through queued calls
+ * and progress, logs and results come back through signals.
+ */
+class ESPSession : public QObject
+{
+    Q_OBJECT
+public:
+    explicit ESPSession(QObject *parent = 0);
+    ~ESPSession();
+
+    enum LogLevel {
+        Info,
+        Warning,
+        Error
+    };
+
+    enum SpiMode {
+        QIO = 0x00,
+        QOUT = 0x01,
+        DIO = 0x02,
+        DOUT = 0x03,
+    };
+
+    ESPRom *rom() const { return m_esp; }
+
+    // Reads the files and patches the SPI mode and size into the boot image header,
+    // files already prepared with the same settings come from the PreparedImageCache
+    static QList<FlashImage> prepareImages(const QList<FlashFile> &files, int flashMode, int flashSizeFreq);
+
+public slots:
+    void open(const QString &portName, int baudRate, int resetMode);
+    void close();
+
+    void writeFlash(const QList<ESPFlasher::FlashFile> &files, int flashMode, int flashSizeFreq,
+                    int flashWindow = 1, bool compress = true, bool diff = false);
+    void writeImages(const QList<ESPFlasher::FlashImage> &images, int flashMode,
+                     int flashWindow = 1, bool compress = true, bool diff = false);
+    // Writes the job with the patches of this device and verifies it as the job asks
+    void writeJob(const ESPFlasher::FlashJob &job, quint32 serial, int flashWindow = 1);
+    void readFlash(const QString &filename, quint32 address, quint32 size);
+    void eraseFlash();
+    void eraseRegion(quint32 address, quint32 size);
+    void loadRam(const QString &filename);
+    void dumpMemory(const QString &filename, quint32 address, quint32 size);
+    void readMemory(quint32 address);
+    void writeMemory(quint32 address, quint32 value, quint32 mask);
+    void run();
+
+signals:
+    void opened(bool ok, const QString &macAddress, const QString &portName);
+    void closed();
+    void started();
+    void finished(bool ok);
+    void logMessage(const QString &text, int level = Info, int row = 0);
+    void fileProgress(int index, int progress);
+    void flashWritten(int bytes);
+    void error(const QString &errorText);
+
+private slots:
+    void romMessage(const QString &text);
+    void romReadProgress(int progress);
+
+private:
+    // Offset into the image and length of a run of sectors to write
+    typedef QPair<quint32, quint32> FlashRange;
+
+    bool isReady();
+    bool writeAll(const QList<FlashImage> &images, int flashMode, int flashWindow, bool compress, bool diff);
+    bool verifyImages(const QList<FlashImage> &images, bool readback);
+    // Logs the link statistics of the write, dumps them as JSON if enabled
+    void finishWrite(bool ok);
+    QList<FlashRange> changedRanges(const QByteArray &image, quint32 address);
+    bool writeResumable(const QByteArray &image, quint32 address, bool deflate, const QString &name, const QString &cacheKey,
+                        int index, int &done, int total, int &row, int &written);
+    bool writeRange(const QByteArray &image, quint32 address, bool deflate, const QString &name, const PreparedBlocks &prepared,
+                    int index, int &done, int total, int &row, int &written, quint32 &acked);
+    quint32 resumeOffset(const QByteArray &image, quint32 address, quint32 checkpoint);
+    bool reconnect(bool stub);
+
+    // Bytes of a range known to be written, kept per device and address
+    QString checkpointKey(quint32 address);
+    quint32 loadCheckpoint(quint32 address, const QByteArray &digest);
+    void saveCheckpoint(quint32 address, const QByteArray &digest, quint32 written);
+    void clearCheckpoint(quint32 address);
+    // After an erase nothing stored for the device holds anymore
+    void clearCheckpoints();
+
+private:
+    ESPRom *m_esp;
+};
+
+} //namespace ESPFlasher
+
+Q_DECLARE_METATYPE(ESPFlasher::FlashFile)
+Q_DECLARE_METATYPE(QList<ESPFlasher::FlashFile>)
+Q_DECLARE_METATYPE(ESPFlasher::FlashImage)
+Q_DECLARE_METATYPE(QList<ESPFlasher::FlashImage>)
+
+#endif // ESPSESSION_H
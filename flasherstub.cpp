@@ -0,0 +1,53 @@
+#include "flasherstub.h"
+
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QCoreApplication>
+#include <QDir>
+
+namespace ESPFlasher {
+
+FlasherStub::FlasherStub(const QString &filename):
+    m_entryPoint(0)
+{
+    if(filename.isEmpty())
+        return;
+
+    QFile file(filename);
+    if(!file.open(QIODevice::ReadOnly)){
+        m_errorText = file.errorString();
+        return;
+    }
+
+    QJsonParseError error;
+    QJsonObject stub = QJsonDocument::fromJson(file.readAll(), &error).object();
+    file.close();
+
+    if(error.error != QJsonParseError::NoError || !stub.contains("entry") || !stub.contains("text")){
+        m_errorText = QString("Invalid flasher stub %1").arg(filename);
+        return;
+    }
+
+    m_entryPoint = (quint32)stub.value("entry").toDouble();
+
+    QList<QString> names;
+    names << "text" << "data";
+    for(int i = 0; i < names.size(); i++){
+        if(!stub.contains(names.at(i)))
+            continue;
+
+        Segment segment;
+        segment.offset = (quint32)stub.value(names.at(i) + "_start").toDouble();
+        segment.data = QByteArray::fromBase64(stub.value(names.at(i)).toString().toLatin1());
+        segment.size = segment.data.size();
+        m_segments.append(segment);
+    }
+}
+
+QString FlasherStub::defaultFilename()
+{
+    return QDir(QCoreApplication::applicationDirPath()).filePath("stub_flasher_8266.json");
+}
+
+} //namespace ESPFlasher
@@ -0,0 +1,41 @@
+#ifndef FLASHERSTUB_H
+#define FLASHERSTUB_H
+
+/*
+ * RAM flasher stub in the esptool JSON format (stub_flasher_8266.json):
+ * base64 "text" and "data" segments with their load addresses and the
+ * entry point. See https://github.com/espressif/esptool.git
+ */
+
+#include <QString>
+#include <QList>
+
+#include "espfirmwareimage.h"
+
+namespace ESPFlasher {
+
+// Flash block size accepted by the stub, in place of ESP_FLASH_BLOCK
+#define ESP_STUB_FLASH_BLOCK    0x4000
+
+class FlasherStub
+{
+public:
+    FlasherStub(const QString &filename = QString());
+
+    bool isValid() const { return !m_segments.isEmpty() && m_errorText.isEmpty(); }
+    QString errorText() const { return m_errorText; }
+
+    QList<Segment> segments() const { return m_segments; }
+    quint32 entryPoint() const { return m_entryPoint; }
+
+    static QString defaultFilename();
+
+private:
+    QList<Segment> m_segments;
+    quint32 m_entryPoint;
+    QString m_errorText;
+};
+
+} //namespace ESPFlasher
+
+#endif // FLASHERSTUB_H
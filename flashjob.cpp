@@ -0,0 +1,341 @@
+#include "flashjob.h"
+#include "tools.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+#include <algorithm>
+
+namespace ESPFlasher {
+
+// Offsets are given as numbers or as strings, in hex with a 0x prefix
+static bool parseNumber(const QJsonValue &value, quint32 *number)
+{
+    bool ok = value.isDouble();
+    if(ok){
+        *number = (quint32)value.toDouble();
+    } else if(value.isString()){
+        *number = value.toString().toUInt(&ok, 0);
+    }
+    return ok;
+}
+
+static bool imageLessThan(const FlashImage &a, const FlashImage &b)
+{
+    return a.offset < b.offset;
+}
+
+FlashJob::FlashJob() :
+    m_baudRate(0),
+    m_flashMode(ESPSession::QIO),
+    m_flashSizeFreq(0),
+    m_compress(true),
+    m_diff(false),
+    m_verify(VerifyNone),
+    m_serialStart(0)
+{
+}
+
+int FlashJob::parseFlashMode(const QString &name)
+{
+    return (QStringList() << "qio" << "qout" << "dio" << "dout").indexOf(name.toLower());
+}
+
+int FlashJob::parseFlashSizeFreq(const QString &size, const QString &freq)
+{
+    // Encoded as in byte 3 of the boot image header
+    int sizeIndex = (QStringList() << "4m" << "2m" << "8m" << "16m" << "32m").indexOf(size.toLower());
+    int freqIndex = (QStringList() << "40m" << "26m" << "20m").indexOf(freq.toLower());
+    if(freq.toLower() == "80m"){
+        freqIndex = 0xf;
+    }
+
+    if(sizeIndex < 0 || freqIndex < 0){
+        return -1;
+    }
+    return (sizeIndex << 4) + freqIndex;
+}
+
+bool FlashJob::fail(const QString &text)
+{
+    m_errorText = text;
+    m_plan.clear();
+    return false;
+}
+
+bool FlashJob::load(const QString &fileName)
+{
+    m_errorText.clear();
+    m_files.clear();
+    m_patches.clear();
+    m_plan.clear();
+
+    QFile file(fileName);
+    if(!file.open(QIODevice::ReadOnly)){
+        return fail(QString("%1: %2").arg(fileName).arg(file.errorString()));
+    }
+
+    QJsonParseError error;
+    QJsonDocument document = QJsonDocument::fromJson(file.readAll(), &error);
+    if(!document.isObject()){
+        return fail(QString("%1: %2").arg(fileName).arg(error.errorString()));
+    }
+
+    if(!parse(document.object(), QFileInfo(fileName).absolutePath()) || !validate()){
+        return false;
+    }
+
+    buildPlan();
+
+    return true;
+}
+
+bool FlashJob::parse(const QJsonObject &json, const QString &basePath)
+{
+    m_name = json.value("name").toString();
+    m_baudRate = json.value("baud").toInt(0);
+    m_compress = json.value("compress").toBool(true);
+    m_diff = json.value("diff").toBool(false);
+    m_serialStart = json.value("serial_start").toInt(0);
+
+    m_flashMode = parseFlashMode(json.value("flash_mode").toString("qio"));
+    m_flashSizeFreq = parseFlashSizeFreq(json.value("flash_size").toString("4m"), json.value("flash_freq").toString("40m"));
+    if(m_flashMode < 0 || m_flashSizeFreq < 0){
+        return fail("Bad flash_mode, flash_size or flash_freq");
+    }
+
+    int verify = (QStringList() << "none" << "digest" << "readback").indexOf(json.value("verify").toString("none"));
+    if(verify < 0){
+        return fail("verify must be none, digest or readback");
+    }
+    m_verify = VerifyPolicy(verify);
+
+    QJsonArray images = json.value("images").toArray();
+    for(int i = 0; i < images.size(); i++){
+        QJsonObject image = images.at(i).toObject();
+        FlashFile file;
+        file.index = i;
+        file.filename = QDir(basePath).absoluteFilePath(image.value("file").toString());
+        if(image.value("file").toString().isEmpty() || !parseNumber(image.value("offset"), &file.offset)){
+            return fail(QString("Image %1 needs a file and an offset").arg(i + 1));
+        }
+        m_files.append(file);
+    }
+
+    if(m_files.isEmpty()){
+        return fail("The job has no image");
+    }
+
+    QJsonArray patches = json.value("patches").toArray();
+    for(int i = 0; i < patches.size(); i++){
+        QJsonObject object = patches.at(i).toObject();
+        FlashPatch patch;
+        if(!parseNumber(object.value("offset"), &patch.offset)){
+            return fail(QString("Patch %1 needs an offset").arg(i + 1));
+        }
+
+        if(object.value("mac").toBool()){
+            patch.source = FlashPatch::MacAddress;
+            patch.size = 6;
+        } else if(object.contains("serial")){
+            patch.source = FlashPatch::SerialNumber;
+            patch.size = object.value("serial").toInt(4);
+            if(patch.size < 1 || patch.size > 4){
+                return fail(QString("Patch %1: serial size must be 1 to 4 bytes").arg(i + 1));
+            }
+        } else {
+            patch.source = FlashPatch::Data;
+            patch.data = QByteArray::fromHex(object.value("data").toString().toLatin1());
+            patch.size = patch.data.size();
+            if(patch.data.isEmpty()){
+                return fail(QString("Patch %1 needs mac, serial or hex data").arg(i + 1));
+            }
+        }
+        m_patches.append(patch);
+    }
+
+    return true;
+}
+
+bool FlashJob::validate()
+{
+    // Size nibble of the header: 4, 2, 8, 16 and 32 MBit
+    static const quint32 flashSizes[] = { 0x80000, 0x40000, 0x100000, 0x200000, 0x400000 };
+    quint32 flashSize = flashSizes[m_flashSizeFreq >> 4];
+
+    for(int i = 0; i < m_files.size(); i++){
+        const FlashFile &file = m_files.at(i);
+        QFileInfo info(file.filename);
+        if(!info.isFile() || !info.isReadable()){
+            return fail(QString("Cannot read %1").arg(file.filename));
+        }
+        if(file.offset % ESP_FLASH_SECTOR){
+            return fail(QString("%1: offset 0x%2 is not sector aligned").arg(info.fileName()).arg(file.offset, 0, 16));
+        }
+        if(file.offset + info.size() > flashSize){
+            return fail(QString("%1 does not fit in the flash").arg(info.fileName()));
+        }
+
+        for(int j = 0; j < i; j++){
+            const FlashFile &other = m_files.at(j);
+            quint32 otherEnd = other.offset + QFileInfo(other.filename).size();
+            if(file.offset < otherEnd && other.offset < file.offset + info.size()){
+                return fail(QString("%1 overlaps %2").arg(info.fileName()).arg(QFileInfo(other.filename).fileName()));
+            }
+        }
+    }
+
+    for(int i = 0; i < m_patches.size(); i++){
+        const FlashPatch &patch = m_patches.at(i);
+        quint32 end = patch.offset + patch.size;
+        if(end > flashSize){
+            return fail(QString("Patch at 0x%1 is outside the flash").arg(patch.offset, 0, 16));
+        }
+
+        // Either inside an image or clear of all of them
+        for(int j = 0; j < m_files.size(); j++){
+            quint32 start = m_files.at(j).offset, stop = start + QFileInfo(m_files.at(j).filename).size();
+            bool overlaps = patch.offset < stop && start < end;
+            bool inside = patch.offset >= start && end <= stop;
+            if(overlaps && !inside){
+                return fail(QString("Patch at 0x%1 straddles %2").arg(patch.offset, 0, 16)
+                            .arg(QFileInfo(m_files.at(j).filename).fileName()));
+            }
+        }
+
+        for(int j = 0; j < i; j++){
+            const FlashPatch &other = m_patches.at(j);
+            if(patch.offset < other.offset + other.size && other.offset < end){
+                return fail(QString("Patches at 0x%1 and 0x%2 overlap").arg(patch.offset, 0, 16).arg(other.offset, 0, 16));
+            }
+        }
+    }
+
+    return true;
+}
+
+void FlashJob::buildPlan()
+{
+    QList<FlashImage> images = ESPSession::prepareImages(m_files, m_flashMode, m_flashSizeFreq);
+
+    // Patches outside of the images need the sectors around them read from
+    // each device, so the rest of their content survives the erase
+    m_patchSectors.clear();
+    for(int i = 0; i < m_patches.size(); i++){
+        const FlashPatch &patch = m_patches.at(i);
+        bool covered = false;
+        for(int j = 0; j < images.size() && !covered; j++){
+            covered = patch.offset >= images.at(j).offset
+                    && patch.offset + patch.size <= images.at(j).offset + images.at(j).data.size();
+        }
+        if(!covered){
+            quint32 start = patch.offset - patch.offset % ESP_FLASH_SECTOR;
+            quint32 end = Tools::divRoundup(patch.offset + patch.size, ESP_FLASH_SECTOR) * ESP_FLASH_SECTOR;
+            for(quint32 sector = start; sector < end; sector += ESP_FLASH_SECTOR){
+                if(!m_patchSectors.contains(sector)){
+                    m_patchSectors.append(sector);
+                }
+            }
+        }
+    }
+    std::sort(m_patchSectors.begin(), m_patchSectors.end());
+
+    m_plan = mergeImages(images);
+}
+
+QList<FlashImage> FlashJob::mergeImages(QList<FlashImage> images)
+{
+    std::sort(images.begin(), images.end(), imageLessThan);
+
+    // Writes ending and starting in the same sector are merged: the gap gets
+    // erased anyway, and each FLASH_BEGIN costs an erase and a round trip
+    QList<FlashImage> merged;
+    for(int i = 0; i < images.size(); i++){
+        FlashImage image = images.at(i);
+        if(!merged.isEmpty()){
+            FlashImage &last = merged.last();
+            quint32 lastEnd = last.offset + last.data.size();
+            quint32 sectorEnd = Tools::divRoundup(lastEnd, ESP_FLASH_SECTOR) * ESP_FLASH_SECTOR;
+            if(image.offset <= sectorEnd){
+                quint32 end = image.offset + image.data.size();
+                if(image.offset > lastEnd){
+                    last.data.append(QByteArray(image.offset - lastEnd, '\xff'));
+                }
+                if(end > lastEnd){
+                    last.data.append(image.data.mid(qMax(lastEnd, image.offset) - image.offset));
+                }
+                // Sectors read from the device may overlap images, image data wins
+                if(image.index >= 0){
+                    last.data.replace(image.offset - last.offset, image.data.size(), image.data);
+                }
+                last.name += "+" + image.name;
+                // Merged data is still determined by its parts and where they go
+                if(!last.cacheKey.isEmpty() && !image.cacheKey.isEmpty()){
+                    last.cacheKey += QString("+%1@%2").arg(image.cacheKey).arg(image.offset - last.offset);
+                } else {
+                    last.cacheKey.clear();
+                }
+                if(last.index < 0){
+                    last.index = image.index;
+                }
+                continue;
+            }
+        }
+        merged.append(image);
+    }
+
+    return merged;
+}
+
+bool FlashJob::usesSource(FlashPatch::Source source) const
+{
+    for(int i = 0; i < m_patches.size(); i++){
+        if(m_patches.at(i).source == source){
+            return true;
+        }
+    }
+    return false;
+}
+
+QList<FlashImage> FlashJob::imagesFor(const QByteArray &macAddress, quint32 serial,
+                                      const QList<FlashImage> &sectors) const
+{
+    QList<FlashImage> images = sectors.isEmpty() ? m_plan : mergeImages(m_plan + sectors);
+
+    for(int i = 0; i < m_patches.size(); i++){
+        const FlashPatch &patch = m_patches.at(i);
+
+        QByteArray bytes;
+        switch(patch.source){
+        case FlashPatch::Data:
+            bytes = patch.data;
+            break;
+        case FlashPatch::MacAddress:
+            bytes = macAddress.left(6);
+            break;
+        case FlashPatch::SerialNumber: {
+            char number[4];
+            quint32toBytes(serial, number);
+            bytes = QByteArray(number, patch.size);
+            break;
+        }
+        }
+
+        for(int j = 0; j < images.size(); j++){
+            FlashImage &image = images[j];
+            if(patch.offset >= image.offset && patch.offset + patch.size <= image.offset + image.data.size()){
+                image.data.replace(patch.offset - image.offset, bytes.size(), bytes);
+                image.cacheKey.clear();
+                break;
+            }
+        }
+    }
+
+    return images;
+}
+
+} //namespace ESPFlasher
@@ -0,0 +1,115 @@
+#ifndef FLASHJOB_H
+#define FLASHJOB_H
+
+/*
+ * A flash job manifest (JSON) describes everything a station needs to
+ * program a device:
+ *
+ * {
+ *   "name": "sensor-v2",
+ *   "baud": 921600,
+ *   "flash_mode": "dio", "flash_size": "32m", "flash_freq": "40m",
+ *   "compress": true, "diff": false,
+ *   "verify": "digest",
+ *   "images": [ { "file": "boot.bin", "offset": "0x00000" }, ... ],
+ *   "patches": [ { "offset": "0x7e000", "mac": true },
+ *                { "offset": "0x7e008", "serial": 4 },
+ *                { "offset": "0x7e010", "data": "cafe" } ],
+ *   "serial_start": 1
+ * }
+ *
+ * It is parsed and validated once, then planned into the writes to run
+ * on every device; only the per-device patches differ between devices.
+ */
+
+#include <QList>
+#include <QString>
+#include <QStringList>
+
+#include "espsession.h"
+
+class QJsonObject;
+
+namespace ESPFlasher {
+
+struct FlashPatch
+{
+    enum Source { Data, MacAddress, SerialNumber };
+
+    Source source;
+    quint32 offset;
+    int size;
+    QByteArray data;
+};
+
+class FlashJob
+{
+public:
+    enum VerifyPolicy {
+        VerifyNone,
+        VerifyDigest,   // MD5 of every sector through the flasher stub
+        VerifyReadback  // reads the whole image back
+    };
+
+    FlashJob();
+
+    bool load(const QString &fileName);
+    bool isValid() const { return m_errorText.isEmpty() && !m_plan.isEmpty(); }
+    QString errorText() const { return m_errorText; }
+
+    QString name() const { return m_name; }
+    qint32 baudRate() const { return m_baudRate; }  // 0 when not set
+    int flashMode() const { return m_flashMode; }
+    int flashSizeFreq() const { return m_flashSizeFreq; }
+    bool compress() const { return m_compress; }
+    bool diff() const { return m_diff; }
+    VerifyPolicy verify() const { return m_verify; }
+    quint32 serialStart() const { return m_serialStart; }
+    bool usesSerial() const { return usesSource(FlashPatch::SerialNumber); }
+    bool usesMacAddress() const { return usesSource(FlashPatch::MacAddress); }
+
+    // Images as listed in the manifest, and the writes planned from them
+    const QList<FlashFile> &files() const { return m_files; }
+    const QList<FlashPatch> &patches() const { return m_patches; }
+    const QList<FlashImage> &plan() const { return m_plan; }
+
+    // Flash sectors holding patches outside of the images, to be read from
+    // each device and passed back to imagesFor() with index -1
+    const QList<quint32> &patchSectors() const { return m_patchSectors; }
+
+    // The plan with the patches of one device applied, shares unpatched data.
+    // The MAC address must have its 6 bytes when the job patches it
+    QList<FlashImage> imagesFor(const QByteArray &macAddress, quint32 serial,
+                                const QList<FlashImage> &sectors = QList<FlashImage>()) const;
+
+    // SPI parameters by name, -1 when unknown
+    static int parseFlashMode(const QString &name);
+    static int parseFlashSizeFreq(const QString &size, const QString &freq);
+
+private:
+    bool parse(const QJsonObject &json, const QString &basePath);
+    bool validate();
+    void buildPlan();
+    static QList<FlashImage> mergeImages(QList<FlashImage> images);
+    bool fail(const QString &text);
+    bool usesSource(FlashPatch::Source source) const;
+
+private:
+    QString m_name;
+    qint32 m_baudRate;
+    int m_flashMode;
+    int m_flashSizeFreq;
+    bool m_compress;
+    bool m_diff;
+    VerifyPolicy m_verify;
+    quint32 m_serialStart;
+    QList<FlashFile> m_files;
+    QList<FlashPatch> m_patches;
+    QList<FlashImage> m_plan;
+    QList<quint32> m_patchSectors;
+    QString m_errorText;
+};
+
+} //namespace ESPFlasher
+
+#endif // FLASHJOB_H
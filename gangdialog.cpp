@@ -0,0 +1,169 @@
+#include "gangdialog.h"
+#include "ui_gangdialog.h"
+#include "gangflasher.h"
+#include "serialportwatcher.h"
+
+#include <QSerialPortInfo>
+#include <QProgressBar>
+#include <QPushButton>
+#include <QSettings>
+
+enum StationColumn {
+    PortColumn,
+    MacColumn,
+    ProgressColumn,
+    StatusColumn
+};
+
+GangDialog::GangDialog(const QList<ESPFlasher::FlashImage> &images, int baudRate, int resetMode,
+                       int flashMode, const QString &busyPort, QWidget *parent) :
+    QDialog(parent),
+    ui(new Ui::GangDialog),
+    m_flasher(new ESPFlasher::GangFlasher(this)),
+    m_portWatcher(new ESPFlasher::SerialPortWatcher(this)),
+    m_images(images),
+    m_baudRate(baudRate),
+    m_resetMode(resetMode),
+    m_flashMode(flashMode),
+    m_busyPort(busyPort)
+{
+    ui->setupUi(this);
+
+    int size = 0;
+    for(int i = 0; i < m_images.size(); i++){
+        size += m_images.at(i).data.size();
+    }
+    ui->imagesLabel->setText(tr("%1 image(s), %2 bytes at %3 baud").arg(m_images.size()).arg(size).arg(m_baudRate));
+
+    connect(m_portWatcher, SIGNAL(portAdded(QSerialPortInfo)), this, SLOT(portAdded(QSerialPortInfo)));
+    connect(m_portWatcher, SIGNAL(portRemoved(QString)), this, SLOT(portRemoved(QString)));
+    connect(ui->startBtn, SIGNAL(clicked(bool)), this, SLOT(start()));
+    connect(m_flasher, SIGNAL(portProgress(QString,int)), this, SLOT(portProgress(QString,int)));
+    connect(m_flasher, SIGNAL(portLog(QString,QString,int)), this, SLOT(portLog(QString,QString,int)));
+    connect(m_flasher, SIGNAL(portFinished(QString,bool,QString)), this, SLOT(portFinished(QString,bool,QString)));
+    connect(m_flasher, SIGNAL(finished(int,int)), this, SLOT(finished(int,int)));
+
+    ui->startBtn->setEnabled(false);
+    m_portWatcher->start();
+}
+
+GangDialog::~GangDialog()
+{
+    delete ui;
+}
+
+void GangDialog::reject()
+{
+    // Sessions block their threads until the current operation is over
+    if(m_flasher->isRunning()){
+        return;
+    }
+
+    QDialog::reject();
+}
+
+void GangDialog::portAdded(const QSerialPortInfo &info)
+{
+    if(info.systemLocation() == m_busyPort || info.isBusy()){
+        return;
+    }
+
+    QListWidgetItem *item = new QListWidgetItem(QString("%1 (%2)").arg(info.portName()).arg(info.description()), ui->portList);
+    item->setData(Qt::UserRole, info.systemLocation());
+    item->setFlags(item->flags() | Qt::ItemIsUserCheckable);
+    item->setCheckState(Qt::Checked);
+
+    ui->startBtn->setEnabled(!m_flasher->isRunning() && !m_images.isEmpty());
+}
+
+void GangDialog::portRemoved(const QString &systemLocation)
+{
+    for(int i = 0; i < ui->portList->count(); i++){
+        if(ui->portList->item(i)->data(Qt::UserRole).toString() == systemLocation){
+            delete ui->portList->takeItem(i);
+            break;
+        }
+    }
+
+    if(ui->portList->count() == 0){
+        ui->startBtn->setEnabled(false);
+    }
+}
+
+void GangDialog::start()
+{
+    QStringList ports;
+    for(int i = 0; i < ui->portList->count(); i++){
+        if(ui->portList->item(i)->checkState() == Qt::Checked){
+            ports << ui->portList->item(i)->data(Qt::UserRole).toString();
+        }
+    }
+
+    if(ports.isEmpty()){
+        return;
+    }
+
+    m_rows.clear();
+    ui->stationTable->setRowCount(ports.size());
+    for(int i = 0; i < ports.size(); i++){
+        m_rows.insert(ports.at(i), i);
+        ui->stationTable->setItem(i, PortColumn, new QTableWidgetItem(ports.at(i)));
+        ui->stationTable->setItem(i, MacColumn, new QTableWidgetItem());
+        ui->stationTable->setItem(i, StatusColumn, new QTableWidgetItem(tr("Connecting...")));
+
+        QProgressBar *progressBar = new QProgressBar;
+        progressBar->setRange(0, 100);
+        progressBar->setValue(0);
+        ui->stationTable->setCellWidget(i, ProgressColumn, progressBar);
+    }
+
+    ui->startBtn->setEnabled(false);
+    ui->portList->setEnabled(false);
+    ui->buttonBox->button(QDialogButtonBox::Close)->setEnabled(false);
+    ui->summaryLabel->setText(tr("Flashing %1 device(s)...").arg(ports.size()));
+
+    QSettings settings;
+    m_flasher->start(ports, m_images, m_baudRate, m_resetMode, m_flashMode,
+                     settings.value("flashWindow", 1).toInt(),
+                     settings.value("compressFlash", true).toBool(),
+                     settings.value("diffFlash", false).toBool());
+}
+
+void GangDialog::portProgress(const QString &port, int progress)
+{
+    QProgressBar *progressBar = qobject_cast<QProgressBar *>(ui->stationTable->cellWidget(m_rows.value(port), ProgressColumn));
+    if(progressBar){
+        progressBar->setValue(progress);
+    }
+}
+
+void GangDialog::portLog(const QString &port, const QString &text, int level)
+{
+    QTableWidgetItem *item = ui->stationTable->item(m_rows.value(port), StatusColumn);
+    if(item){
+        item->setText(text);
+        item->setForeground(level == ESPFlasher::ESPSession::Error ? Qt::red : palette().text().color());
+    }
+}
+
+void GangDialog::portFinished(const QString &port, bool ok, const QString &macAddress)
+{
+    int row = m_rows.value(port);
+    ui->stationTable->item(row, MacColumn)->setText(macAddress.toUpper());
+
+    // Keep the last error in sight when the port failed
+    if(ok){
+        portLog(port, tr("Done"), ESPFlasher::ESPSession::Info);
+        portProgress(port, 100);
+    } else if(ui->stationTable->item(row, StatusColumn)->foreground().color() != Qt::red){
+        portLog(port, tr("Failed"), ESPFlasher::ESPSession::Error);
+    }
+}
+
+void GangDialog::finished(int succeeded, int failed)
+{
+    ui->summaryLabel->setText(tr("%1 device(s) flashed, %2 failed.").arg(succeeded).arg(failed));
+    ui->startBtn->setEnabled(ui->portList->count() > 0);
+    ui->portList->setEnabled(true);
+    ui->buttonBox->button(QDialogButtonBox::Close)->setEnabled(true);
+}
@@ -0,0 +1,53 @@
+#ifndef GANGDIALOG_H
+#define GANGDIALOG_H
+
+#include <QDialog>
+#include <QHash>
+
+#include "espsession.h"
+
+namespace Ui {
+class GangDialog;
+}
+
+class QSerialPortInfo;
+
+namespace ESPFlasher {
+class GangFlasher;
+class SerialPortWatcher;
+}
+
+class GangDialog : public QDialog
+{
+    Q_OBJECT
+
+public:
+    explicit GangDialog(const QList<ESPFlasher::FlashImage> &images, int baudRate, int resetMode,
+                        int flashMode, const QString &busyPort = QString(), QWidget *parent = 0);
+    ~GangDialog();
+
+public slots:
+    void reject();
+
+private slots:
+    void portAdded(const QSerialPortInfo &info);
+    void portRemoved(const QString &systemLocation);
+    void start();
+    void portProgress(const QString &port, int progress);
+    void portLog(const QString &port, const QString &text, int level);
+    void portFinished(const QString &port, bool ok, const QString &macAddress);
+    void finished(int succeeded, int failed);
+
+private:
+    Ui::GangDialog *ui;
+    ESPFlasher::GangFlasher *m_flasher;
+    ESPFlasher::SerialPortWatcher *m_portWatcher;
+    QList<ESPFlasher::FlashImage> m_images;
+    int m_baudRate;
+    int m_resetMode;
+    int m_flashMode;
+    QString m_busyPort;
+    QHash<QString, int> m_rows;
+};
+
+#endif // GANGDIALOG_H
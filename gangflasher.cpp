@@ -0,0 +1,175 @@
+#include "gangflasher.h"
+
+#include <QThread>
+
+namespace ESPFlasher {
+
+GangFlasher::GangFlasher(QObject *parent) :
+    QObject(parent),
+    m_flashMode(0),
+    m_flashWindow(1),
+    m_compress(true),
+    m_diff(false),
+    m_running(0),
+    m_succeeded(0),
+    m_failed(0)
+{
+    qRegisterMetaType<QList<ESPFlasher::FlashImage> >("QList<ESPFlasher::FlashImage>");
+}
+
+GangFlasher::~GangFlasher()
+{
+    clear();
+}
+
+void GangFlasher::clear()
+{
+    for(int i = 0; i < m_stations.size(); i++){
+        m_stations.at(i)->thread->quit();
+        m_stations.at(i)->thread->wait();
+        delete m_stations.at(i)->thread;
+        delete m_stations.at(i);
+    }
+
+    m_stations.clear();
+}
+
+void GangFlasher::start(const QStringList &ports, const QList<FlashImage> &images,
+                        int baudRate, int resetMode, int flashMode,
+                        int flashWindow, bool compress, bool diff)
+{
+    if(isRunning()){
+        return;
+    }
+
+    clear();
+
+    m_images = images;
+    m_flashMode = flashMode;
+    m_flashWindow = flashWindow;
+    m_compress = compress;
+    m_diff = diff;
+    m_running = ports.size();
+    m_succeeded = 0;
+    m_failed = 0;
+
+    for(int i = 0; i < ports.size(); i++){
+        Station *station = new Station;
+        station->port = ports.at(i);
+        station->thread = new QThread;
+        station->session = new ESPSession;
+        station->done = false;
+        m_stations.append(station);
+
+        station->session->moveToThread(station->thread);
+        connect(station->thread, SIGNAL(finished()), station->session, SLOT(deleteLater()));
+        connect(station->session, SIGNAL(opened(bool,QString,QString)), this, SLOT(sessionOpened(bool,QString)));
+        connect(station->session, SIGNAL(finished(bool)), this, SLOT(sessionFinished(bool)));
+        connect(station->session, SIGNAL(logMessage(QString,int,int)), this, SLOT(sessionLog(QString,int,int)));
+        connect(station->session, SIGNAL(fileProgress(int,int)), this, SLOT(sessionProgress(int,int)));
+        connect(station->session, SIGNAL(error(QString)), this, SLOT(sessionError(QString)));
+        station->thread->start();
+
+        emit portStarted(station->port);
+        QMetaObject::invokeMethod(station->session, "open", Q_ARG(QString, station->port),
+                                  Q_ARG(int, baudRate), Q_ARG(int, resetMode));
+    }
+
+    if(ports.isEmpty()){
+        emit finished(0, 0);
+    }
+}
+
+GangFlasher::Station *GangFlasher::station(QObject *session)
+{
+    for(int i = 0; i < m_stations.size(); i++){
+        if(m_stations.at(i)->session == session){
+            return m_stations.at(i);
+        }
+    }
+
+    return 0;
+}
+
+void GangFlasher::sessionOpened(bool ok, const QString &macAddress)
+{
+    Station *station = this->station(sender());
+    if(!station || station->done){
+        return;
+    }
+
+    if(!ok){
+        emit portLog(station->port, tr("Failed to connect to ESP8266."), ESPSession::Error);
+        finishStation(station, false);
+        return;
+    }
+
+    station->macAddress = macAddress;
+    QMetaObject::invokeMethod(station->session, "writeImages", Q_ARG(QList<ESPFlasher::FlashImage>, m_images),
+                              Q_ARG(int, m_flashMode), Q_ARG(int, m_flashWindow),
+                              Q_ARG(bool, m_compress), Q_ARG(bool, m_diff));
+}
+
+void GangFlasher::sessionFinished(bool ok)
+{
+    Station *station = this->station(sender());
+    if(!station || station->done){
+        return;
+    }
+
+    finishStation(station, ok);
+}
+
+void GangFlasher::finishStation(Station *station, bool ok)
+{
+    station->done = true;
+    QMetaObject::invokeMethod(station->session, "close");
+
+    if(ok)
+        m_succeeded++;
+    else
+        m_failed++;
+
+    emit portFinished(station->port, ok, station->macAddress);
+
+    if(--m_running == 0){
+        emit finished(m_succeeded, m_failed);
+    }
+}
+
+void GangFlasher::sessionLog(const QString &text, int level, int row)
+{
+    Q_UNUSED(row);
+
+    Station *station = this->station(sender());
+    if(station){
+        emit portLog(station->port, text, level);
+    }
+}
+
+void GangFlasher::sessionProgress(int index, int progress)
+{
+    Station *station = this->station(sender());
+    if(!station || m_images.isEmpty()){
+        return;
+    }
+
+    station->progress[index] = progress;
+
+    int total = 0;
+    foreach(int value, station->progress){
+        total += value;
+    }
+
+    emit portProgress(station->port, total / m_images.size());
+}
+
+void GangFlasher::sessionError(const QString &errorText)
+{
+    Station *station = this->station(sender());
+    if(station){
+        emit portLog(station->port, errorText, ESPSession::Error);
+    }
+}
+
+} //namespace ESPFlasher
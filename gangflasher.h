@@ -0,0 +1,76 @@
+#ifndef GANGFLASHER_H
+#define GANGFLASHER_H
+
+#include <QObject>
+#include <QStringList>
+#include <QHash>
+
+#include "espsession.h"
+
+class QThread;
+
+namespace ESPFlasher {
+
+/*
+ * Flashes the same images on many serial ports at once. Every port gets its
+ * own ESPSession on its own thread; the prepared images are handed to all of
+ * them through QByteArray's implicit sharing and never modified, so a single
+ * copy is kept in memory whatever the number of ports.
+ */
+class GangFlasher : public QObject
+{
+    Q_OBJECT
+public:
+    explicit GangFlasher(QObject *parent = 0);
+    ~GangFlasher();
+
+    bool isRunning() const { return m_running > 0; }
+
+public slots:
+    void start(const QStringList &ports, const QList<ESPFlasher::FlashImage> &images,
+               int baudRate, int resetMode, int flashMode,
+               int flashWindow = 1, bool compress = true, bool diff = false);
+
+signals:
+    void portStarted(const QString &port);
+    void portProgress(const QString &port, int progress);
+    void portLog(const QString &port, const QString &text, int level);
+    void portFinished(const QString &port, bool ok, const QString &macAddress);
+    void finished(int succeeded, int failed);
+
+private slots:
+    void sessionOpened(bool ok, const QString &macAddress);
+    void sessionFinished(bool ok);
+    void sessionLog(const QString &text, int level, int row);
+    void sessionProgress(int index, int progress);
+    void sessionError(const QString &errorText);
+
+private:
+    struct Station {
+        QString port;
+        QThread *thread;
+        ESPSession *session;
+        QString macAddress;
+        QHash<int, int> progress;
+        bool done;
+    };
+
+    Station *station(QObject *session);
+    void finishStation(Station *station, bool ok);
+    void clear();
+
+private:
+    QList<Station *> m_stations;
+    QList<FlashImage> m_images;
+    int m_flashMode;
+    int m_flashWindow;
+    bool m_compress;
+    bool m_diff;
+    int m_running;
+    int m_succeeded;
+    int m_failed;
+};
+
+} //namespace ESPFlasher
+
+#endif // GANGFLASHER_H
@@ -1,4 +1,6 @@
 #include "mainwindow.h"
+#include "commandlineengine.h"
+#include "flashjob.h"
 
 #include "tools.h"
 
@@ -12,13 +14,24 @@
 #include <QSerialPort>
 #include <QSerialPortInfo>
 #include <QSettings>
+#include <QScopedPointer>
 
 struct ESPFlasherQuery {
-    QString portName;
-    QSerialPort::BaudRate baudRate;
+    ESPFlasher::CommandLineOptions options;
     QString command;
+    QStringList arguments;
 };
 
+// Index of text in names, compared case insensitively, or -1
+static int lookupName(const QString &text, const QStringList &names)
+{
+    for(int i = 0; i < names.size(); i++){
+        if(names.at(i).compare(text, Qt::CaseInsensitive) == 0)
+            return i;
+    }
+    return -1;
+}
+
 enum CommandLineParseResult
 {
     CommandLineOk,
@@ -36,8 +49,27 @@ CommandLineParseResult parseCommandLine(QCommandLineParser &parser, ESPFlasherQu
     QCommandLineOption portOption(QStringList() << "p" << "port", "Serial port device", "/dev/ttyUSB0");
     QCommandLineOption baudOption(QStringList() << "b" << "baud", "Serial port baud rate", "115200");
 
+    QCommandLineOption resetOption("reset-mode", "Reset mode: none, auto, ck, wifio, nodemcu or dtronly.", "mode", "auto");
+    QCommandLineOption flashModeOption("flash-mode", "SPI flash mode: qio, qout, dio or dout.", "mode", "qio");
+    QCommandLineOption flashSizeOption("flash-size", "SPI flash size in MBit: 2m, 4m, 8m, 16m or 32m.", "size", "4m");
+    QCommandLineOption flashFreqOption("flash-freq", "SPI flash speed: 20m, 26m, 40m or 80m.", "freq", "40m");
+    QCommandLineOption noCompressOption("no-compress", "Send flash blocks uncompressed.");
+    QCommandLineOption diffOption("diff", "Only write the sectors that differ.");
+    QCommandLineOption entryOption("entry", "Entry point of make-image.", "address", "0");
+    QCommandLineOption outputOption(QStringList() << "o" << "output", "Output directory of elf2image.", "dir");
+    QCommandLineOption serialOption("serial", "Device serial number of flash-job, instead of the next stored one.", "number");
+
     parser.addOption(portOption);
     parser.addOption(baudOption);
+    parser.addOption(resetOption);
+    parser.addOption(flashModeOption);
+    parser.addOption(flashSizeOption);
+    parser.addOption(flashFreqOption);
+    parser.addOption(noCompressOption);
+    parser.addOption(diffOption);
+    parser.addOption(entryOption);
+    parser.addOption(outputOption);
+    parser.addOption(serialOption);
 
     parser.addPositionalArgument("load-ram", "Download an image to RAM and execute.");
     parser.addPositionalArgument("dump-mem", "Dump arbitrary memory to disk.");
@@ -52,12 +84,14 @@ CommandLineParseResult parseCommandLine(QCommandLineParser &parser, ESPFlasherQu
     parser.addPositionalArgument("flash-id", "Read SPI flash manufacturer and device ID.");
     parser.addPositionalArgument("read-flash", "Read SPI flash content.");
     parser.addPositionalArgument("erase-flash", "Perform Chip Erase on SPI flash.");
+    parser.addPositionalArgument("erase-region", "Erase a region of SPI flash.");
+    parser.addPositionalArgument("flash-job", "Program a device from a JSON job manifest.");
 
 
     const QCommandLineOption helpOption = parser.addHelpOption();
     const QCommandLineOption versionOption = parser.addVersionOption();
 
-    if (!parser.parse(QApplication::arguments())) {
+    if (!parser.parse(QCoreApplication::arguments())) {
         *errorMessage = parser.errorText();
         return CommandLineError;
     }
@@ -70,63 +104,96 @@ CommandLineParseResult parseCommandLine(QCommandLineParser &parser, ESPFlasherQu
 
     if (parser.isSet(portOption)) {
         bool isValid = false;
-        query->portName = parser.value(portOption);
+        query->options.portName = parser.value(portOption);
         QList<QSerialPortInfo>	availablePorts = QSerialPortInfo::availablePorts();
         for(int i = 0; i < availablePorts.size(); i++){
 
-            if(availablePorts.at(i).systemLocation() == query->portName){
+            if(availablePorts.at(i).systemLocation() == query->options.portName){
                 isValid = true;
                 break;
             }
         }
         if(!isValid){
-            *errorMessage = "Bad serial port name: " + query->portName;
+            *errorMessage = "Bad serial port name: " + query->options.portName;
             return CommandLineError;
         }
 
     }
 
     if (parser.isSet(baudOption)) {
+        // Non standard rates are fine, the flasher stub switches to them
         bool isValid = false;
-        const qint32 baudParameter = parser.value(baudOption).toInt();
-        static QList<qint32> standardBaudRates = QSerialPortInfo::standardBaudRates();
-        for(int i = 0; i < standardBaudRates.size(); i++){
-            if(standardBaudRates.at(i) == baudParameter){
-                isValid = true;
-                break;
-            }
+        const qint32 baudParameter = parser.value(baudOption).toInt(&isValid);
+        if(!isValid || baudParameter <= 0){
+            *errorMessage = "Bad baud rate: " + parser.value(baudOption);
+            return CommandLineError;
         }
+        query->options.baudRate = baudParameter;
+        query->options.baudRateSet = true;
+    }
 
+    if (parser.isSet(serialOption)) {
+        bool isValid = false;
+        query->options.serial = parser.value(serialOption).toUInt(&isValid, 0);
         if(!isValid){
-            *errorMessage = "Bad serial port name: " + query->portName;
+            *errorMessage = "Bad serial number: " + parser.value(serialOption);
             return CommandLineError;
         }
-        query->baudRate = (QSerialPort::BaudRate)baudParameter;
     }
 
+    int resetMode = lookupName(parser.value(resetOption), QStringList() << "none" << "auto" << "ck" << "wifio" << "nodemcu" << "dtronly");
+    int flashMode = ESPFlasher::FlashJob::parseFlashMode(parser.value(flashModeOption));
+    int flashSizeFreq = ESPFlasher::FlashJob::parseFlashSizeFreq(parser.value(flashSizeOption), parser.value(flashFreqOption));
+    if(resetMode < 0 || flashMode < 0 || flashSizeFreq < 0){
+        *errorMessage = "Bad reset mode or SPI flash parameter";
+        return CommandLineError;
+    }
+    bool isValid = false;
+    query->options.entryPoint = parser.value(entryOption).toUInt(&isValid, 0);
+    if(!isValid){
+        *errorMessage = "Bad entry point: " + parser.value(entryOption);
+        return CommandLineError;
+    }
+
+    // Same header encoding as the flash size and speed boxes of the main window
+    query->options.resetMode = resetMode;
+    query->options.flashMode = flashMode;
+    query->options.flashSizeFreq = flashSizeFreq;
+    query->options.compress = !parser.isSet(noCompressOption);
+    query->options.diff = parser.isSet(diffOption);
+    query->options.outputPath = parser.value(outputOption);
+
     const QStringList positionalArguments = parser.positionalArguments();
     if (positionalArguments.isEmpty()) {
         *errorMessage = "Argument 'command' missing.";
         return CommandLineOk;
     }
 
-    if (positionalArguments.size() > 1) {
-        *errorMessage = "Several 'command' arguments specified.";
+    query->command = positionalArguments.first();
+    query->arguments = positionalArguments.mid(1);
+
+    if (!ESPFlasher::CommandLineEngine::isCommand(query->command)) {
+        *errorMessage = "Unknown command: " + query->command;
         return CommandLineError;
     }
 
-    query->command = positionalArguments.first();
-
     return CommandLineOk;
 }
 
 int main(int argc, char *argv[])
 {
-    QApplication app(argc, argv);
-    QApplication::setOrganizationName("hibiapps");
+    // Commands run without any widget, font or style, so they start fast and need no display
+    bool headless = false;
+    for(int i = 1; i < argc; i++){
+        if(ESPFlasher::CommandLineEngine::isCommand(QString::fromLocal8Bit(argv[i])))
+            headless = true;
+    }
+
+    QScopedPointer<QCoreApplication> app(headless ? new QCoreApplication(argc, argv) : new QApplication(argc, argv));
+    QCoreApplication::setOrganizationName("hibiapps");
     QCoreApplication::setOrganizationDomain("hibiapps.com");
-    QApplication::setApplicationName("espflasher");
-    QApplication::setApplicationVersion("1.0.0");
+    QCoreApplication::setApplicationName("espflasher");
+    QCoreApplication::setApplicationVersion("1.0.0");
 
     QCommandLineParser parser;
     parser.setApplicationDescription("An open source and cross platform firmware programmer for ESP8266 chip");
@@ -142,20 +209,18 @@ int main(int argc, char *argv[])
         fputs(qPrintable(parser.helpText()), stderr);
         return 1;
     case CommandLineVersionRequested:
-        printf("%s %s\n", qPrintable(QApplication::applicationName()),
-               qPrintable(QApplication::applicationVersion()));
+        printf("%s %s\n", qPrintable(QCoreApplication::applicationName()),
+               qPrintable(QCoreApplication::applicationVersion()));
         return 0;
     case CommandLineHelpRequested:
         parser.showHelp();
         Q_UNREACHABLE();
     }
 
-
-    QStringList imageCommands = QStringList() << "image-info" << "make-image" << "elf2image";
-    if(imageCommands.contains(query.command))
+    if(headless)
     {
-        //TODO:
-        return 0;
+        ESPFlasher::CommandLineEngine engine(query.options);
+        return engine.run(query.command, query.arguments);
     }
     else
     {
@@ -192,6 +257,6 @@ int main(int argc, char *argv[])
         MainWindow w;
         w.show();
 
-        return app.exec();
+        return app->exec();
     }
 }
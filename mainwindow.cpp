@@ -1,8 +1,8 @@
 #include "mainwindow.h"
 #include "ui_mainwindow.h"
 #include "constants.h"
-#include "esprom.h"
-#include "espfirmwareimage.h"
+#include "espsession.h"
+#include "flashjob.h"
 #include "tools.h"
 #include "imagechooser.h"
 #include "flashinputdialog.h"
@@ -11,6 +11,8 @@
 #include "makeimagedialog.h"
 #include "versiondialog.h"
 #include "preferencesdialog.h"
+#include "gangdialog.h"
+#include "serialportwatcher.h"
 
 #ifdef WITH_POPPLER_QT5
 #include <poppler/qt5/poppler-qt5.h>
@@ -29,15 +31,20 @@
 #include <QMessageBox>
 #include <QSettings>
 #include <QDesktopServices>
-#include <QTimer>
+#include <QThread>
+
+#include <algorithm>
 
 MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent),
     ui(new Ui::MainWindow),
-    m_esp(new ESPFlasher::ESPRom),
+    m_session(new ESPFlasher::ESPSession),
+    m_sessionThread(new QThread(this)),
+    m_connected(false),
     m_inputDialog(),
     m_makeImageDialog(),
     m_aboutDialog(),
+    m_gangDialog(),
     m_currentAction(NoAction)
 {
     ui->setupUi(this);
@@ -48,15 +55,26 @@ MainWindow::MainWindow(QWidget *parent) :
 
     fillComboBoxes();
 
-    connect(m_esp, SIGNAL(commandStarted(ESPCommand)), this, SLOT(espCmdStarted()));
-    connect(m_esp, SIGNAL(commandFinished(ESPCommand)), this, SLOT(espCmdFinished()));
-    connect(m_esp, SIGNAL(commandError(QString)), this, SLOT(espError(QString)));
+    // Serial I/O runs in its own thread so repaints never stall the link
+    qRegisterMetaType<QList<ESPFlasher::FlashFile> >("QList<ESPFlasher::FlashFile>");
+    m_session->moveToThread(m_sessionThread);
+    connect(m_sessionThread, SIGNAL(finished()), m_session, SLOT(deleteLater()));
+    m_sessionThread->start();
+
+    connect(m_session, SIGNAL(started()), this, SLOT(espCmdStarted()));
+    connect(m_session, SIGNAL(finished(bool)), this, SLOT(espCmdFinished()));
+    connect(m_session, SIGNAL(error(QString)), this, SLOT(espError(QString)));
+    connect(m_session, SIGNAL(opened(bool,QString,QString)), this, SLOT(sessionOpened(bool,QString,QString)));
+    connect(m_session, SIGNAL(logMessage(QString,int,int)), this, SLOT(sessionLog(QString,int,int)));
+    connect(m_session, SIGNAL(fileProgress(int,int)), this, SLOT(sessionProgress(int,int)));
+    connect(m_session, SIGNAL(flashWritten(int)), this, SLOT(flashWritten(int)));
     connect(ui->actionImport_image_file_list, SIGNAL(triggered(bool)), this, SLOT(importImageList()));
     connect(ui->actionExport_image_file_list, SIGNAL(triggered(bool)), this, SLOT(exportImageList()));
     connect(ui->openBtn, SIGNAL(clicked(bool)), this, SLOT(open()));
     connect(ui->writeFlashBtn, SIGNAL(clicked(bool)), SLOT(writeFlash()));
     connect(ui->readFlashBtn, SIGNAL(clicked(bool)), SLOT(readFlash()));
     connect(ui->eraseFlashBtn, SIGNAL(clicked(bool)), this, SLOT(eraseFlash()));
+    connect(ui->eraseRegionBtn, SIGNAL(clicked(bool)), this, SLOT(eraseRegion()));
     connect(ui->loadRamBtn, SIGNAL(clicked(bool)), SLOT(loadRam()));
     connect(ui->dumpMemoryBtn, SIGNAL(clicked(bool)), SLOT(dumpMemory()));
     connect(ui->readMemoryBtn, SIGNAL(clicked(bool)), SLOT(readMemory()));
@@ -65,6 +83,7 @@ MainWindow::MainWindow(QWidget *parent) :
     connect(ui->runImageBtn, SIGNAL(clicked(bool)), this, SLOT(runImage()));
     connect(ui->copyMacBtn, SIGNAL(clicked(bool)), SLOT(copyMAC()));
     connect(ui->actionPreferences, SIGNAL(triggered(bool)), this, SLOT(openPreferences()));
+    connect(ui->actionGang_flash, SIGNAL(triggered(bool)), this, SLOT(gangFlash()));
     connect(ui->actionAbout, SIGNAL(triggered(bool)), this, SLOT(openAbout()));
     connect(ui->actionExit, SIGNAL (triggered ()), qApp, SLOT (quit ()));
     connect(ui->serialPort, SIGNAL(currentIndexChanged(int)), SLOT(deviceSettingsChanged()));
@@ -85,15 +104,17 @@ MainWindow::MainWindow(QWidget *parent) :
 
     enableActions();
 
-    m_scanTimer = new QTimer(this);
-    connect(m_scanTimer,SIGNAL(timeout()),this,SLOT(scanSerialPorts()));
-    m_scanTimer->start(1000);
+    m_portWatcher = new ESPFlasher::SerialPortWatcher(this);
+    connect(m_portWatcher, SIGNAL(portAdded(QSerialPortInfo)), this, SLOT(portAdded(QSerialPortInfo)));
+    connect(m_portWatcher, SIGNAL(portRemoved(QString)), this, SLOT(portRemoved(QString)));
+    m_portWatcher->start();
 }
 
 MainWindow::~MainWindow()
 {
-    delete m_esp;
-    delete m_scanTimer;
+    m_sessionThread->quit();
+    m_sessionThread->wait();
+
     delete ui;
 }
 
@@ -132,35 +153,34 @@ void MainWindow::addFileField()
     ui->verticalLayoutFT->addWidget(fileField);
 }
 
-void MainWindow::scanSerialPorts()
+void MainWindow::portAdded(const QSerialPortInfo &info)
 {
-    QSettings settings;
+    ui->serialPort->addItem(info.portName(), info.systemLocation());
 
-    int index = ui->serialPort->currentIndex();
-    QString currentPort = ui->serialPort->currentText();
-    QString serialPort = ui->serialPort->currentData().toString();
-    bool disconnected = true;
-
-    ui->serialPort->clear();
-
-    ui->serialPort->addItem("-- Port --", "");
-
-    QList<QSerialPortInfo> availablePorts = QSerialPortInfo::availablePorts();
-    foreach (const QSerialPortInfo &info, availablePorts) {
-        ui->serialPort->addItem(info.portName(), info.systemLocation());
-        if(info.systemLocation() == serialPort){
-            disconnected = false;
+    // Pick up the last used port again when it comes back
+    if(ui->serialPort->currentIndex() <= 0){
+        QSettings settings;
+        if(info.portName() == settings.value("serialPort", "").toString()){
+            ui->serialPort->setCurrentIndex(ui->serialPort->count() - 1);
         }
     }
+}
+
+void MainWindow::portRemoved(const QString &systemLocation)
+{
+    int index = ui->serialPort->findData(systemLocation);
+    if(index <= 0){
+        return;
+    }
 
-    if(disconnected && m_esp->isPortOpen()){
-        m_esp->closePort();
+    if(index == ui->serialPort->currentIndex() && m_connected){
+        QMetaObject::invokeMethod(m_session, "close");
+        m_connected = false;
         enableActions();
         ui->logList->addEntry(tr("Disconnected from ESP8266."), LogList::Warning);
-        return;
     }
 
-    ui->serialPort->setCurrentText(index > -1 ? currentPort : settings.value("serialPort", "").toString());
+    ui->serialPort->removeItem(index);
 }
 
 void MainWindow::deviceSettingsChanged()
@@ -176,21 +196,23 @@ void MainWindow::fillComboBoxes()
 {
     QSettings settings;
 
+    // The ports themselves are added by the port watcher
     ui->serialPort->addItem("-- Port --", "");
-    QList<QSerialPortInfo>	availablePorts = QSerialPortInfo::availablePorts();
-    for(int i = 0; i < availablePorts.size(); i++){
-        ui->serialPort->addItem(availablePorts.at(i).portName(), availablePorts.at(i).systemLocation());
-    }
-    ui->serialPort->setCurrentText(settings.value("serialPort", "").toString());
-
-    ui->openBtn->setEnabled(!availablePorts.isEmpty());
+    ui->openBtn->setEnabled(false);
 
     ui->baudRate->addItem("-- Baud rate --", 0);
 
+    // Rates above 115200 are reached through the flasher stub
+    QList<qint32> baudRates;
+    baudRates << 230400 << 460800 << 921600 << 1500000 << 2000000;
     static QList<qint32> standardBaudRates = QSerialPortInfo::standardBaudRates();
-    for(int i = 0; i < standardBaudRates.size(); i++){
-        if(standardBaudRates.at(i) > 9599 && standardBaudRates.at(i) < 115201)
-            ui->baudRate->addItem(QString::number(standardBaudRates.at(i)), standardBaudRates.at(i));
+    for(int i = standardBaudRates.size() - 1; i >= 0; i--){
+        if(standardBaudRates.at(i) > 9599 && !baudRates.contains(standardBaudRates.at(i)))
+            baudRates.prepend(standardBaudRates.at(i));
+    }
+    std::sort(baudRates.begin(), baudRates.end());
+    for(int i = 0; i < baudRates.size(); i++){
+        ui->baudRate->addItem(QString::number(baudRates.at(i)), baudRates.at(i));
     }
     ui->baudRate->setCurrentIndex(settings.value("baudRate", 0).toInt());
 
@@ -238,7 +260,7 @@ void MainWindow::fillComboBoxes()
 
 void MainWindow::enableActions()
 {
-    bool deviceConnected = m_esp->isPortOpen();
+    bool deviceConnected = m_connected;
     ui->writeFlashBtn->setEnabled(deviceConnected);
     ui->readFlashBtn->setEnabled(deviceConnected);
     ui->readMemoryBtn->setEnabled(deviceConnected);
@@ -247,6 +269,7 @@ void MainWindow::enableActions()
     ui->runImageBtn->setEnabled(deviceConnected);
     ui->loadRamBtn->setEnabled(deviceConnected);
     ui->eraseFlashBtn->setEnabled(deviceConnected);
+    ui->eraseRegionBtn->setEnabled(deviceConnected);
 
     ui->macAddressGroup->setEnabled(deviceConnected);
 #ifdef WITH_POPPLER_QT5
@@ -260,8 +283,9 @@ void MainWindow::enableActions()
 
 void MainWindow::open()
 {
-    if(m_esp->isPortOpen()){
-        m_esp->closePort();
+    if(m_connected){
+        QMetaObject::invokeMethod(m_session, "close");
+        m_connected = false;
         enableActions();
         ui->logList->addEntry(tr("Disconnected from ESP8266."), LogList::Warning);
         return;
@@ -275,18 +299,22 @@ void MainWindow::open()
         return;
     }
 
-    m_esp->setSerialPort(serialPort, (QSerialPort::BaudRate)baudRate);
-    m_esp->setResetMode(resetMode);
-
     ui->openBtn->setEnabled(false);
     setCursor(Qt::WaitCursor);
 
     ui->logList->addEntry(tr("Connecting..."));
 
-    QApplication::processEvents();
+    QMetaObject::invokeMethod(m_session, "open", Q_ARG(QString, serialPort),
+                              Q_ARG(int, baudRate), Q_ARG(int, resetMode));
+}
 
-    if(m_esp->openPort()){
-        ui->logList->addEntry(tr("Connected to ESP8266 on %1").arg(m_esp->portName()));
+void MainWindow::sessionOpened(bool ok, const QString &macAddress, const QString &portName)
+{
+    m_connected = ok;
+    m_macAddress = macAddress;
+
+    if(ok){
+        ui->logList->addEntry(tr("Connected to ESP8266 on %1").arg(portName));
         displayMAC();
     }
 
@@ -294,18 +322,35 @@ void MainWindow::open()
     setCursor(Qt::ArrowCursor);
     enableActions();
 
-    if(!m_esp->isPortOpen()){
+    if(!ok){
         ui->logList->addEntry(tr("Failed to connect to ESP8266"), LogList::Error);
     }
 }
 
+void MainWindow::sessionLog(const QString &text, int level, int row)
+{
+    ui->logList->addEntry(text, (LogList::LogLevel)level, row);
+}
+
+void MainWindow::sessionProgress(int index, int progress)
+{
+    if(index >= 0 && index < m_filesFields.size()){
+        m_filesFields.at(index)->setProgress(progress);
+    }
+}
+
+void MainWindow::flashWritten(int bytes)
+{
+    QMessageBox::information(this, "", QString("Flash complete! (Wrote %1 bytes).").arg(bytes), QMessageBox::Ok);
+}
+
 void MainWindow::displayMAC()
 {
-    if(!m_esp->isPortOpen()){
+    if(!m_connected){
         return;
     }
 
-    QString macAddress =  m_esp->macAddress().toUpper();
+    QString macAddress =  m_macAddress.toUpper();
 #ifdef WITH_POPPLER_QT5
     QString filename(macAddress +".pdf");
     BarcodePrinter *printer = new BarcodePrinter(filename);
@@ -337,11 +382,11 @@ void MainWindow::displayMAC()
 #ifdef WITH_POPPLER_QT5
 void MainWindow::printMAC()
 {
-    if(!m_esp->isPortOpen()){
+    if(!m_connected){
         return;
     }
 
-    QString macAddress =  m_esp->macAddress().toUpper();
+    QString macAddress =  m_macAddress.toUpper();
     QString filename(macAddress +".pdf");
     if(!QFileInfo(filename).exists()){
         return;
@@ -375,108 +420,83 @@ void MainWindow::printMAC()
 
 void MainWindow::copyMAC()
 {
-    if(m_esp->isPortOpen()){
-        QApplication::clipboard()->setText(m_esp->macAddress());
+    if(m_connected){
+        QApplication::clipboard()->setText(m_macAddress);
     }
 }
 
 void MainWindow::writeFlash()
 {  
-    if(!m_esp->isPortOpen()){
+    if(!m_connected){
         return;
     }
 
     ui->tabWidget->setCurrentIndex(1);
 
-    quint8 flashMode = (quint8)ui->spiMode->currentData().toInt();
-    quint8 flashSizeFreq = (quint8)ui->flashSize->currentData().toInt() + (quint8)ui->spiSpeed->currentData().toInt();
-    QByteArray flashInfo;
-    flashInfo.append(flashMode);
-    flashInfo.append(flashSizeFreq);
+    QSettings settings;
+    int flashWindow = settings.value("flashWindow", 1).toInt();
+    bool compress = settings.value("compressFlash", true).toBool();
+    bool diff = settings.value("diffFlash", false).toBool();
+
+    int flashMode = ui->spiMode->currentData().toInt();
+    int flashSizeFreq = ui->flashSize->currentData().toInt() + ui->spiSpeed->currentData().toInt();
 
-    int totalWritten = 0;
+    QMetaObject::invokeMethod(m_session, "writeFlash", Q_ARG(QList<ESPFlasher::FlashFile>, flashFiles()),
+                              Q_ARG(int, flashMode), Q_ARG(int, flashSizeFreq), Q_ARG(int, flashWindow),
+                              Q_ARG(bool, compress), Q_ARG(bool, diff));
+}
+
+QList<ESPFlasher::FlashFile> MainWindow::flashFiles() const
+{
+    QList<ESPFlasher::FlashFile> files;
     for(int i = 0; i < m_filesFields.size(); i++)
     {
         if(!m_filesFields.at(i)->isValid()){
             continue;
         }
 
-        QString filename = m_filesFields.at(i)->filename();
-        quint32 address = m_filesFields.at(i)->offset();
-        QFile file(filename);
-        if(!file.open(QIODevice::ReadOnly)){
-            continue;
-        }
-
-        m_filesFields.at(i)->setProgress(0);
-        QByteArray image = file.readAll();
-        quint32 blocks = ESPFlasher::Tools::divRoundup(image.size(), ESP_FLASH_BLOCK);
-        if(!m_esp->flashBegin(blocks * ESP_FLASH_BLOCK, address)){
-            ui->logList->addEntry("Failed to enter Flash download mode", LogList::Error);
-            return;
-        }
-
-        quint32 seq = 0;
-        int written = 0, pos = 0;
-        while(pos < image.size())
-        {
-            ui->logList->addEntry(QString::asprintf(WRITE_FLASH_PROGRESS,
-                                                    QFileInfo(filename).fileName().toLatin1().data(),
-                                                    address + seq * ESP_FLASH_BLOCK,
-                                                    100 * (seq + 1) / blocks), LogList::Info, seq);
-            m_filesFields.at(i)->setProgress(100 * (seq + 1) / blocks);
-
-            QByteArray block = image.mid(pos, ESP_FLASH_BLOCK);
-            if (address == 0 && seq == 0 && block.at(0) == '\xe9'){
-                block = block.mid(0, 2) + flashInfo + block.mid(4);
-            }
-            int blockSize = block.size();
-            for(int j = 0; j < (ESP_FLASH_BLOCK - blockSize); j++){
-                block.append("\xff", 1);
-            }
-            if(!m_esp->flashBlock(block, seq)){
-                ui->logList->addEntry(QString("Failed to write to target Flash after seq %1").arg(seq), LogList::Error);
-                return;
-            }
+        ESPFlasher::FlashFile file;
+        file.index = i;
+        file.filename = m_filesFields.at(i)->filename();
+        file.offset = m_filesFields.at(i)->offset();
+        files.append(file);
+    }
 
-            seq += 1;
-            pos += ESP_FLASH_BLOCK;
-            written += block.size();
+    return files;
+}
 
-        }
+void MainWindow::gangFlash()
+{
+    int flashMode = ui->spiMode->currentData().toInt();
+    int flashSizeFreq = ui->flashSize->currentData().toInt() + ui->spiSpeed->currentData().toInt();
+    int baudRate = ui->baudRate->currentData().toInt();
+    int resetMode = ui->resetMode->currentData().toInt();
 
-        totalWritten += written;
-        file.close();
-        ui->logList->addEntry(QString::asprintf("Wrote %d bytes at 0x%08X",  written, address), LogList::Info, seq);
+    // Same settings as a single port needs to open
+    if(baudRate == 0 || resetMode == 0){
+        ui->logList->addEntry(tr("Select a baud rate and a reset mode to gang flash"), LogList::Warning);
+        return;
     }
 
-    if(flashMode == DIO){
-        m_esp->flashUnlockDIO();
-    }
+    // Prepared once here, every port flashes from the same copy
+    QList<ESPFlasher::FlashImage> images = ESPFlasher::ESPSession::prepareImages(flashFiles(), flashMode, flashSizeFreq);
+    QString busyPort = m_connected ? ui->serialPort->currentData().toString() : QString();
+
+    ESPFlasher::Tools::openDialog (m_gangDialog, images, baudRate, resetMode, flashMode, busyPort, this);
 
-    QMessageBox::information(this, "", QString("Flash complete! (Wrote %1 bytes).").arg(totalWritten), QMessageBox::Ok);
+    delete m_gangDialog;
 }
 
 void MainWindow::readFlash()
 {
-    if(!m_esp->isPortOpen()){
+    if(!m_connected){
         return;
     }
 
     if(ESPFlasher::Tools::openDialog (m_inputDialog, FlashInputDialog::FileField | FlashInputDialog::AddressField | FlashInputDialog::SizeField, this) == QDialog::Accepted)
     {
-        QString fileName = m_inputDialog->filename();
-        quint32 address = m_inputDialog->address();
-        quint32 size = m_inputDialog->size();
-
-        QFile file(fileName);
-        if(file.open(QIODevice::WriteOnly)){
-            ui->logList->addEntry(QString::asprintf("Reading %d bytes at 0x%08X...",  size, address));
-            QByteArray data = m_esp->flashRead(address, 1024, ESPFlasher::Tools::divRoundup(size, 1024)).mid(0, size);
-            file.write(data);
-            ui->logList->addEntry(QString::asprintf("Reading %d bytes at 0x%08X...done",  data.size(), address), LogList::Info, 1);
-            file.close();
-        }
+        QMetaObject::invokeMethod(m_session, "readFlash", Q_ARG(QString, m_inputDialog->filename()),
+                                  Q_ARG(quint32, m_inputDialog->address()), Q_ARG(quint32, m_inputDialog->size()));
     }
 
     delete m_inputDialog;
@@ -484,15 +504,29 @@ void MainWindow::readFlash()
 
 void MainWindow::eraseFlash()
 {
-    if(m_esp->isPortOpen() && m_esp->flashErase())
+    if(m_connected){
+        QMetaObject::invokeMethod(m_session, "eraseFlash");
+    }
+}
+
+void MainWindow::eraseRegion()
+{
+    if(!m_connected){
+        return;
+    }
+
+    if(ESPFlasher::Tools::openDialog (m_inputDialog, FlashInputDialog::AddressField | FlashInputDialog::SizeField, this) == QDialog::Accepted)
     {
-        ui->logList->addEntry("Flash content deleted.", LogList::Warning);
+        QMetaObject::invokeMethod(m_session, "eraseRegion", Q_ARG(quint32, m_inputDialog->address()),
+                                  Q_ARG(quint32, m_inputDialog->size()));
     }
+
+    delete m_inputDialog;
 }
 
 void MainWindow::loadRam()
 {
-    if(!m_esp->isPortOpen()){
+    if(!m_connected){
         return;
     }
 
@@ -501,54 +535,23 @@ void MainWindow::loadRam()
         return;
     }
 
-    ESPFlasher::ESPFirmwareImage image(fileName);
-
-    ui->logList->addEntry(tr("RAM boot..."));
-    for(int i = 0; i < image.segments().size(); i++){
-        ESPFlasher::Segment segment = image.segments().at(i);
-        ui->logList->addEntry(QString::asprintf("Downloading %d bytes at %08X...", segment.size, segment.offset), LogList::Info, i);
-        m_esp->memBegin(segment.size, ESPFlasher::Tools::divRoundup(segment.size, ESP_RAM_BLOCK), ESP_RAM_BLOCK, segment.offset);
-        int seq = 0, pos = 0;
-        while(pos < segment.data.size()){
-            m_esp->memBlock(segment.data.mid(pos, ESP_RAM_BLOCK), seq);
-            pos += ESP_RAM_BLOCK;
-            seq++;
-        }
-    }
-    ui->logList->addEntry(QString::asprintf("All segments done, executing at %08X", image.entryPoint()));
-    m_esp->memFinish(image.entryPoint());
+    QMetaObject::invokeMethod(m_session, "loadRam", Q_ARG(QString, fileName));
 }
 
 void MainWindow::dumpMemory()
 {
 
-    if(!m_esp->isPortOpen()){
+    if(!m_connected){
         return;
     }
 
     if(ESPFlasher::Tools::openDialog (m_inputDialog, FlashInputDialog::FileField | FlashInputDialog::AddressField | FlashInputDialog::SizeField, this) == QDialog::Accepted)
     {
         QString fileName = m_inputDialog->filename();
-        quint32 address = m_inputDialog->address();
-        quint32 size = m_inputDialog->size();
-
-        if(fileName.isEmpty()){
-            return;
-        }
 
-        int k = 0;
-        QFile file(fileName);
-        if(file.open(QIODevice::WriteOnly)){
-            for(quint32 i = 0; i < size / 4; i++){
-                char bytes[4];
-                quint32 value = m_esp->readReg(address + (i * 4));
-                ESPFlasher::quint32toBytes(value, &bytes[0]);
-                file.write(bytes, 4);
-                if(file.pos() % 1024 == 0){
-                    ui->logList->addEntry(QString::asprintf("%lld bytes read... (%lld %%)", file.pos(), file.pos() * 100 / size), LogList::Info, k++);
-                }
-            }
-            file.close();
+        if(!fileName.isEmpty()){
+            QMetaObject::invokeMethod(m_session, "dumpMemory", Q_ARG(QString, fileName),
+                                      Q_ARG(quint32, m_inputDialog->address()), Q_ARG(quint32, m_inputDialog->size()));
         }
     }
 
@@ -557,15 +560,13 @@ void MainWindow::dumpMemory()
 
 void MainWindow::readMemory()
 {
-    if(!m_esp->isPortOpen()){
+    if(!m_connected){
         return;
     }
 
     if(ESPFlasher::Tools::openDialog (m_inputDialog, FlashInputDialog::AddressField, this) == QDialog::Accepted)
     {
-        quint32 address = m_inputDialog->address();
-        quint32 value = m_esp->readReg(address);
-        ui->logList->addEntry(QString::asprintf("0x%08X = 0x%08X", address, value));
+        QMetaObject::invokeMethod(m_session, "readMemory", Q_ARG(quint32, m_inputDialog->address()));
     }
 
     delete m_inputDialog;
@@ -573,18 +574,14 @@ void MainWindow::readMemory()
 
 void MainWindow::writeMemory()
 {
-    if(!m_esp->isPortOpen()){
+    if(!m_connected){
         return;
     }
 
     if(ESPFlasher::Tools::openDialog (m_inputDialog, FlashInputDialog::AddressField | FlashInputDialog::ValueField | FlashInputDialog::MaskField, this) == QDialog::Accepted)
     {
-        quint32 address = m_inputDialog->address();
-        quint32 value = m_inputDialog->value();
-        quint32 mask = m_inputDialog->mask();
-
-        m_esp->writeReg(address, value, mask, 0);
-        ui->logList->addEntry(QString::asprintf("Wrote 0x%08X, mask 0x%08X to 0x%08X", value, mask, address));
+        QMetaObject::invokeMethod(m_session, "writeMemory", Q_ARG(quint32, m_inputDialog->address()),
+                                  Q_ARG(quint32, m_inputDialog->value()), Q_ARG(quint32, m_inputDialog->mask()));
     }
 
     delete m_inputDialog;
@@ -599,12 +596,11 @@ void MainWindow::makeImage()
 
 void MainWindow::runImage()
 {
-    if(!m_esp->isPortOpen()){
+    if(!m_connected){
         return;
     }
 
-    m_esp->run();
-    ui->logList->addEntry("Image is running on device...");
+    QMetaObject::invokeMethod(m_session, "run");
 }
 
 void MainWindow::importImageList()
@@ -612,32 +608,72 @@ void MainWindow::importImageList()
     QSettings settings;
 
     QString fileName = QFileDialog::getOpenFileName(this, tr("Import from text file"),
-                                                    settings.value("workingDir", QDir::currentPath()).toString(), tr("Text Files (*.txt)"));
+                                                    settings.value("workingDir", QDir::currentPath()).toString(),
+                                                    tr("Image lists (*.txt *.json);;Text Files (*.txt);;Flash jobs (*.json)"));
     if(fileName.isEmpty()){
         return;
     }
 
-    QFile file(fileName);
-    if(file.open(QIODevice::ReadOnly | QIODevice::Text)){
-        int i = 0;
-        while(!file.atEnd()){
-            QString line = QString::fromLocal8Bit(file.readLine().simplified().data());
-            if(!line.startsWith("#")){
-                QList<QString> fileAddress = line.split(":");
-                if(fileAddress.size() == 2){
-                    m_filesFields.at(i)->setFilename(fileAddress.at(0));
-                    m_filesFields.at(i)->setOffset(fileAddress.at(1).toInt(0, 16));
-                    i++;
+    if(fileName.endsWith(".json", Qt::CaseInsensitive)){
+        importFlashJob(fileName);
+    } else {
+        QFile file(fileName);
+        if(file.open(QIODevice::ReadOnly | QIODevice::Text)){
+            int i = 0;
+            while(!file.atEnd()){
+                QString line = QString::fromLocal8Bit(file.readLine().simplified().data());
+                if(!line.startsWith("#")){
+                    QList<QString> fileAddress = line.split(":");
+                    if(fileAddress.size() == 2){
+                        if(i >= m_filesFields.size()){
+                            addFileField();
+                        }
+                        m_filesFields.at(i)->setFilename(fileAddress.at(0));
+                        m_filesFields.at(i)->setOffset(fileAddress.at(1).toInt(0, 16));
+                        i++;
+                    }
                 }
             }
+            file.close();
+            ui->tabWidget->setCurrentIndex(1);
         }
-        file.close();
-        ui->tabWidget->setCurrentIndex(1);
     }
 
     settings.setValue("workingDir", QFileInfo(fileName).absolutePath());
 }
 
+void MainWindow::importFlashJob(const QString &fileName)
+{
+    ESPFlasher::FlashJob job;
+    if(!job.load(fileName)){
+        ui->logList->addEntry(job.errorText(), LogList::Error);
+        return;
+    }
+
+    const QList<ESPFlasher::FlashFile> &files = job.files();
+    while(m_filesFields.size() < files.size()){
+        addFileField();
+    }
+    for(int i = 0; i < m_filesFields.size(); i++){
+        m_filesFields.at(i)->setFilename(i < files.size() ? files.at(i).filename : QString());
+        m_filesFields.at(i)->setOffset(i < files.size() ? files.at(i).offset : 0);
+    }
+
+    ui->spiMode->setCurrentIndex(qMax(ui->spiMode->findData(job.flashMode()), 0));
+    ui->flashSize->setCurrentIndex(qMax(ui->flashSize->findData(job.flashSizeFreq() & 0xf0), 0));
+    ui->spiSpeed->setCurrentIndex(qMax(ui->spiSpeed->findData(job.flashSizeFreq() & 0x0f), 0));
+    int baudIndex = job.baudRate() ? ui->baudRate->findData(job.baudRate()) : -1;
+    if(baudIndex >= 0){
+        ui->baudRate->setCurrentIndex(baudIndex);
+    }
+
+    if(!job.patches().isEmpty()){
+        ui->logList->addEntry(tr("%1 per device patch(es) of '%2' are only applied by the flash-job command")
+                              .arg(job.patches().size()).arg(QFileInfo(fileName).fileName()), LogList::Warning);
+    }
+    ui->tabWidget->setCurrentIndex(1);
+}
+
 void MainWindow::exportImageList()
 {
     QSettings settings;
@@ -675,6 +711,7 @@ void MainWindow::espCmdStarted()
     ui->runImageBtn->setEnabled(false);
     ui->loadRamBtn->setEnabled(false);
     ui->eraseFlashBtn->setEnabled(false);
+    ui->eraseRegionBtn->setEnabled(false);
 }
 
 void MainWindow::espCmdFinished()
@@ -690,6 +727,7 @@ void MainWindow::espCmdFinished()
     ui->runImageBtn->setEnabled(true);
     ui->loadRamBtn->setEnabled(true);
     ui->eraseFlashBtn->setEnabled(true);
+    ui->eraseRegionBtn->setEnabled(true);
 }
 
 void MainWindow::espError(const QString &errorText)
@@ -9,13 +9,15 @@ class QLineEdit;
 class QToolButton;
 class QCheckBox;
 class QLabel;
-class QTimer;
+class QThread;
+class QSerialPortInfo;
 
 class FlashInputDialog;
 class MakeImageDialog;
 class ImageChooser;
 class VersionDialog;
 class PreferencesDialog;
+class GangDialog;
 
 
 namespace Ui {
@@ -23,7 +25,9 @@ class MainWindow;
 }
 
 namespace ESPFlasher {
-class ESPRom;
+class ESPSession;
+class SerialPortWatcher;
+struct FlashFile;
 }
 
 class MainWindow : public QMainWindow
@@ -34,13 +38,6 @@ public:
     explicit MainWindow(QWidget *parent = 0);
     ~MainWindow();
 
-    enum SpiMode {
-        QIO = 0x00,
-        QOUT = 0x01,
-        DIO = 0x02,
-        DOUT = 0x03,
-    };
-
     enum Action {
         NoAction,
         WriteFlash,
@@ -58,12 +55,15 @@ private slots:
     void importImageList();
     void exportImageList();
 
-    void scanSerialPorts();
+    void portAdded(const QSerialPortInfo &info);
+    void portRemoved(const QString &systemLocation);
 
     void open();
     void writeFlash();
+    void gangFlash();
     void readFlash();
     void eraseFlash();
+    void eraseRegion();
     void loadRam();
     void dumpMemory();
     void readMemory();
@@ -82,6 +82,11 @@ private slots:
     void espCmdFinished();
     void espError(const QString &errorText);
 
+    void sessionOpened(bool ok, const QString &macAddress, const QString &portName);
+    void sessionLog(const QString &text, int level, int row);
+    void sessionProgress(int index, int progress);
+    void flashWritten(int bytes);
+
     void openPreferences();
     void openAbout();
 
@@ -89,18 +94,24 @@ private:
     void fillComboBoxes();
     void displayMAC();
     void enableActions();
+    void importFlashJob(const QString &fileName);
+    QList<ESPFlasher::FlashFile> flashFiles() const;
 
 private:
     Ui::MainWindow *ui;
-    ESPFlasher::ESPRom *m_esp;
+    ESPFlasher::ESPSession *m_session;
+    QThread *m_sessionThread;
+    bool m_connected;
+    QString m_macAddress;
     QList<ImageChooser *> m_filesFields;
     QPointer<FlashInputDialog> m_inputDialog;
     QPointer<MakeImageDialog> m_makeImageDialog;
     QPointer<VersionDialog> m_aboutDialog;
     QPointer<PreferencesDialog> m_preferencesDialog;
+    QPointer<GangDialog> m_gangDialog;
     Action m_currentAction;
     QString m_workingDir;
-    QTimer *m_scanTimer;
+    ESPFlasher::SerialPortWatcher *m_portWatcher;
 
 };
 
@@ -105,52 +105,11 @@ void MakeImageDialog::elf2Image()
     QString tcPath = useSysPath ? "" : settings.value("tcPath").toString();
 
     enableActions(false);
-    ESPFlasher::ESPFirmwareImage image;
     ESPFlasher::ELFFile elfFile(elfFilename, tcPath);
-    QList<QString> sections;
-    QList<QString> starts;
-    sections << ".text" << ".data" << ".rodata";
-    starts << "_text_start" << "_data_start" << "_rodata_start";
-
     connect(&elfFile, SIGNAL(elfError(QString)), this, SLOT(onElfError(QString)));
+    connect(&elfFile, SIGNAL(message(QString)), this, SLOT(onElfMessage(QString)));
 
-    bool ok;
-    quint32 entryPoint = elfFile.getEntryPoint(&ok);
-    if(!ok)
-        return;
-
-    image.setEntryPoint(entryPoint);
-    image.setFlashMode(m_flashMode);
-    image.setFlashSizeFreq(m_flashSizeFreq);
-
-    for(int i = 0; i < sections.size(); i++)
-    {
-        bool ok;
-        quint32 address = elfFile.getSymbolAddr(starts.at(i), &ok);
-        if(!ok)
-            break;
-        QByteArray data = elfFile.loadSection(sections.at(i));
-        image.addSegment(address, data);
-        ui->logList->addEntry(QString("Section %1 (%2 bytes at 0x%3)")
-                              .arg(sections.at(i))
-                              .arg(data.size())
-                              .arg(address, 1, 16));
-    }
-
-    image.save(QDir(imagePath).filePath("0x00000.bin"));
-
-    QByteArray data = elfFile.loadSection(".irom0.text");
-    quint32 off = elfFile.getSymbolAddr("_irom0_text_start") - 0x40200000;
-    QFile file( QDir(imagePath).filePath(QString::asprintf("0x%05x.bin", off)));
-
-    if(file.open(QIODevice::WriteOnly))
-    {
-        file.write(data.data(), data.size());
-        file.close();
-        ui->logList->addEntry(QString("Section .irom0.text (%1 bytes at 0x%2)")
-                              .arg(data.size())
-                              .arg(off + 0x40200000, 1, 16));
-    }
+    elfFile.saveImages(imagePath, m_flashMode, m_flashSizeFreq);
 
     enableActions(true);
 }
@@ -196,3 +155,8 @@ void MakeImageDialog::onElfError(const QString &errorText)
 {
     ui->logList->addEntry(errorText, LogList::Error);
 }
+
+void MakeImageDialog::onElfMessage(const QString &text)
+{
+    ui->logList->addEntry(text);
+}
@@ -26,6 +26,7 @@ private slots:
     void setImageFile();
 
     void onElfError(const QString &errorText);
+    void onElfMessage(const QString &text);
 
     void elf2Image();
     void makeImage();
@@ -1,5 +1,6 @@
 #include "preferencesdialog.h"
 #include "ui_preferencesdialog.h"
+#include "flasherstub.h"
 
 #include <QSettings>
 #include <QFileDialog>
@@ -14,6 +15,10 @@ PreferencesDialog::PreferencesDialog(QWidget *parent) :
     connect(ui->useSystemPATH, SIGNAL(clicked(bool)), ui->tcPathLineEdit, SLOT(setDisabled(bool)));
     connect(ui->useSystemPATH, SIGNAL(clicked(bool)), ui->tcPathBtn, SLOT(setDisabled(bool)));
     connect(ui->tcPathBtn, SIGNAL(clicked(bool)), this, SLOT(setToolchainPath()));
+    connect(ui->stubFileBtn, SIGNAL(clicked(bool)), this, SLOT(setStubFile()));
+    connect(ui->traceDirBtn, SIGNAL(clicked(bool)), this, SLOT(setTraceDir()));
+    connect(ui->statsDirBtn, SIGNAL(clicked(bool)), this, SLOT(setStatsDir()));
+    connect(ui->imageCacheDirBtn, SIGNAL(clicked(bool)), this, SLOT(setImageCacheDir()));
 
     loadSettings();
 }
@@ -33,6 +38,45 @@ void PreferencesDialog::setToolchainPath()
     }
 }
 
+void PreferencesDialog::setStubFile()
+{
+    QString fileName = QFileDialog::getOpenFileName(this, tr("Flasher stub"), QDir::currentPath(), tr("JSON Files (*.json)"));
+
+    if(!fileName.isEmpty()){
+        ui->stubFileLineEdit->setText(fileName);
+    }
+}
+
+void PreferencesDialog::setTraceDir()
+{
+    QString dir = QFileDialog::getExistingDirectory(this, tr("Protocol traces"), QDir::currentPath(), QFileDialog::ShowDirsOnly
+                                                         | QFileDialog::DontResolveSymlinks);
+
+    if(!dir.isEmpty()){
+        ui->traceDirLineEdit->setText(dir);
+    }
+}
+
+void PreferencesDialog::setStatsDir()
+{
+    QString dir = QFileDialog::getExistingDirectory(this, tr("Statistics"), QDir::currentPath(), QFileDialog::ShowDirsOnly
+                                                         | QFileDialog::DontResolveSymlinks);
+
+    if(!dir.isEmpty()){
+        ui->statsDirLineEdit->setText(dir);
+    }
+}
+
+void PreferencesDialog::setImageCacheDir()
+{
+    QString dir = QFileDialog::getExistingDirectory(this, tr("Image cache"), QDir::currentPath(), QFileDialog::ShowDirsOnly
+                                                         | QFileDialog::DontResolveSymlinks);
+
+    if(!dir.isEmpty()){
+        ui->imageCacheDirLineEdit->setText(dir);
+    }
+}
+
 void PreferencesDialog::loadSettings()
 {
     QSettings settings;
@@ -42,6 +86,14 @@ void PreferencesDialog::loadSettings()
     ui->tcPathLineEdit->setEnabled(!ui->useSystemPATH->isChecked());
     ui->tcPathBtn->setEnabled(!ui->useSystemPATH->isChecked());
     ui->useDarkTheme->setChecked(settings.value("useDarkTheme", true).toBool());
+    ui->flashWindow->setValue(settings.value("flashWindow", 1).toInt());
+    ui->stubFileLineEdit->setText(settings.value("stubFile", ESPFlasher::FlasherStub::defaultFilename()).toString());
+    ui->compressFlash->setChecked(settings.value("compressFlash", true).toBool());
+    ui->diffFlash->setChecked(settings.value("diffFlash", false).toBool());
+    ui->flashRetries->setValue(settings.value("flashRetries", 2).toInt());
+    ui->traceDirLineEdit->setText(settings.value("traceDir", "").toString());
+    ui->statsDirLineEdit->setText(settings.value("statsDir", "").toString());
+    ui->imageCacheDirLineEdit->setText(settings.value("imageCacheDir", "").toString());
 }
 
 void PreferencesDialog::saveSettings()
@@ -51,6 +103,14 @@ void PreferencesDialog::saveSettings()
     settings.setValue("useSystemPATH", ui->useSystemPATH->isChecked());
     settings.setValue("tcPath", ui->tcPathLineEdit->text());
     settings.setValue("useDarkTheme", ui->useDarkTheme->isChecked());
+    settings.setValue("flashWindow", ui->flashWindow->value());
+    settings.setValue("stubFile", ui->stubFileLineEdit->text());
+    settings.setValue("compressFlash", ui->compressFlash->isChecked());
+    settings.setValue("diffFlash", ui->diffFlash->isChecked());
+    settings.setValue("flashRetries", ui->flashRetries->value());
+    settings.setValue("traceDir", ui->traceDirLineEdit->text());
+    settings.setValue("statsDir", ui->statsDirLineEdit->text());
+    settings.setValue("imageCacheDir", ui->imageCacheDirLineEdit->text());
 
     //accept();
 }
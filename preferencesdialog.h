@@ -19,6 +19,10 @@ private slots:
     void loadSettings();
     void saveSettings();
     void setToolchainPath();
+    void setStubFile();
+    void setTraceDir();
+    void setStatsDir();
+    void setImageCacheDir();
 
 private:
     Ui::PreferencesDialog *ui;
@@ -0,0 +1,218 @@
+#include "preparedimagecache.h"
+#include "tools.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QSaveFile>
+#include <QSettings>
+
+namespace ESPFlasher {
+
+static const quint32 CACHE_FILE_MAGIC = 0x45504243; // "EPBC"
+static const quint32 CACHE_FILE_VERSION = 1;
+// Default size of the on-disk cache, in MB
+static const int CACHE_DIR_LIMIT = 256;
+
+PreparedImageCache::PreparedImageCache() :
+    m_images(32 * 1024),
+    m_blocks(64 * 1024)
+{
+}
+
+PreparedImageCache *PreparedImageCache::instance()
+{
+    static PreparedImageCache cache;
+    return &cache;
+}
+
+bool PreparedImageCache::image(const FlashFile &file, int flashMode, int flashSizeFreq, FlashImage *image)
+{
+    QFileInfo info(file.filename);
+    if(!info.isFile()){
+        return false;
+    }
+
+    QString key = QString("%1|%2|%3|%4|%5").arg(info.canonicalFilePath()).arg(info.size())
+            .arg(info.lastModified().toMSecsSinceEpoch()).arg(file.offset == 0 ? flashMode : -1)
+            .arg(file.offset == 0 ? flashSizeFreq : -1);
+
+    QMutexLocker locker(&m_mutex);
+
+    if(m_images.contains(key)){
+        *image = *m_images.object(key);
+    } else {
+        QFile input(file.filename);
+        if(!input.open(QIODevice::ReadOnly)){
+            return false;
+        }
+
+        image->data = input.readAll();
+        image->cacheKey = key;
+
+        // Only the boot image at the start of the flash carries the SPI settings
+        if(file.offset == 0 && image->data.size() >= 4 && image->data.at(0) == '\xe9'){
+            image->data[2] = (char)flashMode;
+            image->data[3] = (char)flashSizeFreq;
+        }
+
+        m_images.insert(key, new FlashImage(*image), image->data.size() / 1024 + 1);
+    }
+
+    image->index = file.index;
+    image->name = info.fileName();
+    image->offset = file.offset;
+
+    return true;
+}
+
+PreparedBlocks PreparedImageCache::prepare(const QByteArray &data, bool deflate, int blockSize)
+{
+    PreparedBlocks prepared;
+    prepared.blockSize = blockSize;
+    prepared.size = data.size();
+    prepared.digest = QCryptographicHash::hash(data, QCryptographicHash::Md5);
+
+    QByteArray payload = data;
+    if(deflate){
+        // qCompress() prefixes the zlib stream with the uncompressed size
+        payload = qCompress(data, 9).mid(4);
+    }
+    prepared.dataSize = payload.size();
+
+    for(int pos = 0; pos < payload.size(); pos += blockSize){
+        QByteArray block = payload.mid(pos, blockSize);
+        if(!deflate && block.size() < blockSize){
+            block.append(QByteArray(blockSize - block.size(), '\xff'));
+        }
+        prepared.blocks.append(block);
+        prepared.checksums.append((char)Tools::checksum(block));
+    }
+
+    return prepared;
+}
+
+PreparedBlocks PreparedImageCache::blocks(const QString &key, const QByteArray &data, bool deflate, int blockSize)
+{
+    if(key.isEmpty()){
+        return prepare(data, deflate, blockSize);
+    }
+
+    QString blocksKey = QString("%1|%2|%3|%4").arg(key).arg(data.size()).arg(deflate).arg(blockSize);
+
+    QMutexLocker locker(&m_mutex);
+    if(m_blocks.contains(blocksKey)){
+        return *m_blocks.object(blocksKey);
+    }
+
+    // Sessions flashing the same image wait for the first one to prepare it,
+    // the others go on in parallel
+    QSharedPointer<QMutex> keyLock = m_preparing.value(blocksKey);
+    if(!keyLock){
+        keyLock = QSharedPointer<QMutex>(new QMutex);
+        m_preparing.insert(blocksKey, keyLock);
+    }
+    locker.unlock();
+
+    QMutexLocker keyLocker(keyLock.data());
+
+    locker.relock();
+    if(m_blocks.contains(blocksKey)){
+        return *m_blocks.object(blocksKey);
+    }
+    locker.unlock();
+
+    // Blocks kept on disk by an earlier run are as good as fresh ones
+    PreparedBlocks prepared;
+    QSettings settings;
+    QString cacheDir = settings.value("imageCacheDir", "").toString();
+    QString fileName;
+    if(!cacheDir.isEmpty()){
+        QByteArray hash = QCryptographicHash::hash(blocksKey.toUtf8(), QCryptographicHash::Sha1);
+        fileName = QDir(cacheDir).filePath(QString("%1.blocks").arg(QString(hash.toHex())));
+    }
+
+    if(fileName.isEmpty() || !loadBlocks(fileName, blocksKey, &prepared)){
+        prepared = prepare(data, deflate, blockSize);
+        if(!fileName.isEmpty()){
+            saveBlocks(fileName, blocksKey, prepared);
+            trimDirectory(cacheDir, settings.value("imageCacheLimit", CACHE_DIR_LIMIT).toLongLong() * 1024 * 1024);
+        }
+    }
+
+    locker.relock();
+    m_blocks.insert(blocksKey, new PreparedBlocks(prepared), prepared.dataSize / 1024 + 1);
+    m_preparing.remove(blocksKey);
+
+    return prepared;
+}
+
+void PreparedImageCache::clear()
+{
+    QMutexLocker locker(&m_mutex);
+    m_images.clear();
+    m_blocks.clear();
+}
+
+bool PreparedImageCache::loadBlocks(const QString &fileName, const QString &key, PreparedBlocks *blocks)
+{
+    QFile file(fileName);
+    if(!file.open(QIODevice::ReadOnly)){
+        return false;
+    }
+
+    QDataStream in(&file);
+    in.setVersion(QDataStream::Qt_5_0);
+
+    quint32 magic, version;
+    QString fileKey;
+    in >> magic >> version >> fileKey;
+    if(magic != CACHE_FILE_MAGIC || version != CACHE_FILE_VERSION || fileKey != key){
+        return false;
+    }
+
+    in >> blocks->blockSize >> blocks->size >> blocks->dataSize >> blocks->digest >> blocks->blocks >> blocks->checksums;
+    if(in.status() != QDataStream::Ok || blocks->blocks.size() != blocks->checksums.size()){
+        return false;
+    }
+
+    // Used files are kept longest when the directory is trimmed
+    file.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+
+    return true;
+}
+
+void PreparedImageCache::saveBlocks(const QString &fileName, const QString &key, const PreparedBlocks &blocks)
+{
+    // Written aside and renamed, a reader never sees a partial file
+    QSaveFile file(fileName);
+    if(!file.open(QIODevice::WriteOnly)){
+        return;
+    }
+
+    QDataStream out(&file);
+    out.setVersion(QDataStream::Qt_5_0);
+    out << CACHE_FILE_MAGIC << CACHE_FILE_VERSION << key;
+    out << blocks.blockSize << blocks.size << blocks.dataSize << blocks.digest << blocks.blocks << blocks.checksums;
+
+    file.commit();
+}
+
+void PreparedImageCache::trimDirectory(const QString &dir, qint64 limit)
+{
+    // Newest first, everything past the limit goes
+    QFileInfoList files = QDir(dir).entryInfoList(QStringList() << "*.blocks", QDir::Files, QDir::Time);
+    qint64 total = 0;
+    for(int i = 0; i < files.size(); i++){
+        total += files.at(i).size();
+        if(total > limit){
+            QFile::remove(files.at(i).absoluteFilePath());
+        }
+    }
+}
+
+} //namespace ESPFlasher
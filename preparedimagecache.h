@@ -0,0 +1,68 @@
+#ifndef PREPAREDIMAGECACHE_H
+#define PREPAREDIMAGECACHE_H
+
+#include <QByteArray>
+#include <QCache>
+#include <QList>
+#include <QHash>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QString>
+
+#include "espsession.h"
+
+namespace ESPFlasher {
+
+// The blocks of one write as they go on the wire, with their checksums
+struct PreparedBlocks
+{
+    PreparedBlocks() : blockSize(0), size(0), dataSize(0) {}
+
+    QList<QByteArray> blocks;   // padded to the block size, or deflated
+    QByteArray checksums;       // one per block
+    QByteArray digest;          // MD5 of the data written
+    int blockSize;
+    quint32 size;               // bytes written to flash
+    quint32 dataSize;           // bytes sent, compressed size when deflated
+};
+
+/*
+ * Images and blocks prepared for one file and set of flash settings,
+ * shared by every session so that flashing the same firmware again does
+ * no host side work. Files are keyed by path, size and modification time;
+ * blocks may also be kept on disk, in the "imageCacheDir" setting, up to
+ * "imageCacheLimit" MB with the least recently used files dropped first.
+ */
+class PreparedImageCache
+{
+public:
+    static PreparedImageCache *instance();
+
+    // Reads the file and patches its boot header, or returns the prepared copy
+    bool image(const FlashFile &file, int flashMode, int flashSizeFreq, FlashImage *image);
+
+    // Blocks of the data of an image, only cached when a key is given
+    PreparedBlocks blocks(const QString &key, const QByteArray &data, bool deflate, int blockSize);
+    static PreparedBlocks prepare(const QByteArray &data, bool deflate, int blockSize);
+
+    void clear();
+
+private:
+    PreparedImageCache();
+
+    bool loadBlocks(const QString &fileName, const QString &key, PreparedBlocks *blocks);
+    void saveBlocks(const QString &fileName, const QString &key, const PreparedBlocks &blocks);
+    static void trimDirectory(const QString &dir, qint64 limit);
+
+private:
+    // Guards the caches, blocks are prepared under the lock of their key
+    QMutex m_mutex;
+    QHash<QString, QSharedPointer<QMutex> > m_preparing;
+    // Costs are in KB
+    QCache<QString, FlashImage> m_images;
+    QCache<QString, PreparedBlocks> m_blocks;
+};
+
+} //namespace ESPFlasher
+
+#endif // PREPAREDIMAGECACHE_H
@@ -0,0 +1,393 @@
+#include "protocoltrace.h"
+#include "slipcodec.h"
+#include "tools.h"
+
+#include <QDateTime>
+#include <QHash>
+#include <QMap>
+
+namespace ESPFlasher {
+
+static void appendVarint(QByteArray &out, quint64 value)
+{
+    while(value >= 0x80){
+        out.append(char((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.append(char(value));
+}
+
+static bool readVarint(QFile &file, quint64 *value)
+{
+    *value = 0;
+    for(int shift = 0; shift < 64; shift += 7){
+        char byte;
+        if(!file.getChar(&byte)){
+            return false;
+        }
+        *value |= quint64(byte & 0x7f) << shift;
+        if(!(byte & 0x80)){
+            return true;
+        }
+    }
+    return false;
+}
+
+TraceWriter::TraceWriter() :
+    m_last(0)
+{
+}
+
+bool TraceWriter::open(const QString &fileName)
+{
+    close();
+
+    m_file.setFileName(fileName);
+    if(!m_file.open(QIODevice::WriteOnly)){
+        return false;
+    }
+
+    char start[8];
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    quint32toBytes(now & 0xffffffff, &start[0]);
+    quint32toBytes(now >> 32, &start[4]);
+
+    m_file.write(TRACE_MAGIC, 8);
+    m_file.putChar(TRACE_VERSION);
+    m_file.write(start, 8);
+
+    m_clock.start();
+    m_last = 0;
+
+    return true;
+}
+
+void TraceWriter::close()
+{
+    if(m_file.isOpen()){
+        m_file.close();
+    }
+}
+
+void TraceWriter::record(TraceRecord::Type type, const char *data, int size)
+{
+    if(!m_file.isOpen()){
+        return;
+    }
+
+    qint64 now = m_clock.nsecsElapsed() / 1000;
+
+    QByteArray header;
+    header.append(char(type));
+    appendVarint(header, now - m_last);
+    appendVarint(header, size);
+    m_last = now;
+
+    // Buffered by QFile, the serial link never waits on the disk
+    m_file.write(header);
+    m_file.write(data, size);
+}
+
+void TraceWriter::mark(const QString &text)
+{
+    QByteArray data = text.toUtf8();
+    record(TraceRecord::Marker, data.constData(), data.size());
+}
+
+TraceReader::TraceReader() :
+    m_startTime(0),
+    m_timestamp(0)
+{
+}
+
+bool TraceReader::open(const QString &fileName)
+{
+    m_file.setFileName(fileName);
+    if(!m_file.open(QIODevice::ReadOnly)){
+        m_errorString = m_file.errorString();
+        return false;
+    }
+
+    QByteArray header = m_file.read(17);
+    if(header.size() != 17 || !header.startsWith(TRACE_MAGIC) || header.at(8) != TRACE_VERSION){
+        m_errorString = "Not a protocol trace";
+        return false;
+    }
+
+    m_startTime = bytes2quint32(header.constData() + 9) | (qint64(bytes2quint32(header.constData() + 13)) << 32);
+    m_timestamp = 0;
+
+    return true;
+}
+
+bool TraceReader::next(TraceRecord *record)
+{
+    char type;
+    quint64 delta;
+    quint64 size;
+
+    if(!m_file.getChar(&type)){
+        return false;
+    }
+
+    // A capture cut short by a crash ends with a partial record
+    if(type > TraceRecord::Marker || !readVarint(m_file, &delta) || !readVarint(m_file, &size)){
+        m_errorString = "Truncated record";
+        return false;
+    }
+
+    record->data = m_file.read(size);
+    if((quint64)record->data.size() != size){
+        m_errorString = "Truncated record";
+        return false;
+    }
+
+    m_timestamp += delta;
+    record->type = TraceRecord::Type(type);
+    record->timestamp = m_timestamp;
+
+    return true;
+}
+
+QString TraceFrame::describe() const
+{
+    const char *data = frame.constData() + 8;
+    int size = frame.size() - 8;
+
+    switch(kind){
+    case Marker:
+        return QString("* %1").arg(QString::fromUtf8(frame));
+    case Data:
+        return QString("< data %1 bytes").arg(frame.size());
+    case Response: {
+        QString text = QString("< %1 value=0x%2").arg(TraceReplayer::commandName(cmd))
+                .arg(bytes2quint32(frame.constData() + 4), 8, 16, QChar('0'));
+        if(size >= 2){
+            text += QString(" status=%1/%2").arg((quint8)data[size - 2]).arg((quint8)data[size - 1]);
+        }
+        if(latency >= 0){
+            text += QString::asprintf(" (%.3f ms)", latency / 1000.0);
+        }
+        return text;
+    }
+    case Request:
+        break;
+    }
+
+    QString text = QString("> %1").arg(TraceReplayer::commandName(cmd));
+    if(retransmit){
+        text += " [retransmit]";
+    }
+
+    switch(cmd){
+    case 0x02: case 0x05: case 0x10:
+        if(size >= 16){
+            text += QString(" size=%1 blocks=%2 block=%3 offset=0x%4").arg(bytes2quint32(data))
+                    .arg(bytes2quint32(data + 4)).arg(bytes2quint32(data + 8))
+                    .arg(bytes2quint32(data + 12), 8, 16, QChar('0'));
+        }
+        break;
+    case 0x03: case 0x07: case 0x11:
+        if(size >= 16){
+            text += QString(" seq=%1 size=%2").arg(bytes2quint32(data + 4)).arg(bytes2quint32(data));
+        }
+        break;
+    case 0x06:
+        if(size >= 8){
+            text += QString(" flag=%1 entry=0x%2").arg(bytes2quint32(data)).arg(bytes2quint32(data + 4), 8, 16, QChar('0'));
+        }
+        break;
+    case 0x09:
+        if(size >= 8){
+            text += QString(" 0x%1=0x%2").arg(bytes2quint32(data), 8, 16, QChar('0')).arg(bytes2quint32(data + 4), 8, 16, QChar('0'));
+        }
+        break;
+    case 0x0a:
+        if(size >= 4){
+            text += QString(" 0x%1").arg(bytes2quint32(data), 8, 16, QChar('0'));
+        }
+        break;
+    case 0x0f:
+        if(size >= 4){
+            text += QString(" baud=%1").arg(bytes2quint32(data));
+        }
+        break;
+    case 0x13: case 0xd1: case 0xd2:
+        if(size >= 8){
+            text += QString(" offset=0x%1 size=%2").arg(bytes2quint32(data), 8, 16, QChar('0')).arg(bytes2quint32(data + 4));
+        }
+        break;
+    default:
+        text += QString(" %1 bytes").arg(size);
+        break;
+    }
+
+    return text;
+}
+
+TraceReplayer::TraceReplayer() :
+    m_framingErrors(0)
+{
+}
+
+QString TraceReplayer::commandName(quint8 cmd)
+{
+    switch(cmd){
+    case 0x02: return "FLASH_BEGIN";
+    case 0x03: return "FLASH_DATA";
+    case 0x04: return "FLASH_END";
+    case 0x05: return "MEM_BEGIN";
+    case 0x06: return "MEM_END";
+    case 0x07: return "MEM_DATA";
+    case 0x08: return "SYNC";
+    case 0x09: return "WRITE_REG";
+    case 0x0a: return "READ_REG";
+    case 0x0f: return "CHANGE_BAUD";
+    case 0x10: return "FLASH_DEFL_BEGIN";
+    case 0x11: return "FLASH_DEFL_DATA";
+    case 0x12: return "FLASH_DEFL_END";
+    case 0x13: return "SPI_FLASH_MD5";
+    case 0xd1: return "ERASE_REGION";
+    case 0xd2: return "READ_FLASH";
+    default: return QString("CMD_0x%1").arg(cmd, 2, 16, QChar('0'));
+    }
+}
+
+bool TraceReplayer::replay(const QString &fileName)
+{
+    m_frames.clear();
+    m_framingErrors = 0;
+
+    TraceReader reader;
+    if(!reader.open(fileName)){
+        m_errorString = reader.errorString();
+        return false;
+    }
+
+    SlipDecoder sent;
+    SlipDecoder received;
+    QHash<quint8, QList<int> > pending;
+
+    TraceRecord record;
+    while(reader.next(&record)){
+        if(record.type == TraceRecord::Marker){
+            TraceFrame marker;
+            marker.kind = TraceFrame::Marker;
+            marker.timestamp = record.timestamp;
+            marker.cmd = 0;
+            marker.frame = record.data;
+            marker.latency = -1;
+            marker.retransmit = false;
+            m_frames.append(marker);
+            continue;
+        }
+
+        SlipDecoder &decoder = record.type == TraceRecord::Sent ? sent : received;
+        decoder.feed(record.data);
+
+        while(decoder.hasFrame()){
+            TraceFrame frame;
+            frame.timestamp = record.timestamp;
+            frame.frame = decoder.takeFrame();
+            frame.cmd = frame.frame.size() > 1 ? frame.frame.at(1) : 0;
+            frame.latency = -1;
+            frame.retransmit = false;
+
+            bool header = frame.frame.size() >= 8
+                    && bytes2quint16(frame.frame.constData() + 2) == frame.frame.size() - 8;
+
+            if(record.type == TraceRecord::Sent){
+                frame.kind = TraceFrame::Request;
+                QList<int> &waiting = pending[frame.cmd];
+                // A request sent again while its twin is unanswered replaces it
+                if(!waiting.isEmpty() && m_frames.at(waiting.last()).frame == frame.frame){
+                    frame.retransmit = true;
+                    waiting.removeLast();
+                }
+                waiting.append(m_frames.size());
+            } else if(header && frame.frame.at(0) == 0x01){
+                frame.kind = TraceFrame::Response;
+                QList<int> &waiting = pending[frame.cmd];
+                if(!waiting.isEmpty()){
+                    frame.latency = frame.timestamp - m_frames.at(waiting.takeFirst()).timestamp;
+                }
+            } else {
+                frame.kind = TraceFrame::Data;
+            }
+
+            m_frames.append(frame);
+        }
+    }
+
+    m_framingErrors = sent.errors() + received.errors();
+    m_errorString = reader.errorString();
+
+    return true;
+}
+
+QString TraceReplayer::summary(qint64 gapThreshold) const
+{
+    struct Stats {
+        int count;
+        int retransmits;
+        int answered;
+        qint64 total;
+        qint64 max;
+    };
+
+    QMap<quint8, Stats> stats;
+    QString gaps;
+
+    for(int i = 0; i < m_frames.size(); i++){
+        const TraceFrame &frame = m_frames.at(i);
+
+        if(i > 0 && frame.timestamp - m_frames.at(i - 1).timestamp > gapThreshold){
+            gaps += QString::asprintf("  %12.6f  idle %.3f ms before ", frame.timestamp / 1e6,
+                                      (frame.timestamp - m_frames.at(i - 1).timestamp) / 1000.0);
+            gaps += frame.describe() + "\n";
+        }
+
+        if(frame.kind != TraceFrame::Request && frame.kind != TraceFrame::Response){
+            continue;
+        }
+
+        if(!stats.contains(frame.cmd)){
+            Stats empty = {0, 0, 0, 0, 0};
+            stats.insert(frame.cmd, empty);
+        }
+        Stats &entry = stats[frame.cmd];
+
+        if(frame.kind == TraceFrame::Request){
+            entry.count++;
+            entry.retransmits += frame.retransmit;
+        } else if(frame.latency >= 0){
+            entry.answered++;
+            entry.total += frame.latency;
+            entry.max = qMax(entry.max, frame.latency);
+        }
+    }
+
+    QString text = QString("%1 %2 %3 %4 %5 %6\n").arg("Command", -18).arg("Sent", 8).arg("Retrans", 8)
+            .arg("Answered", 9).arg("Avg ms", 10).arg("Max ms", 10);
+
+    for(QMap<quint8, Stats>::const_iterator it = stats.constBegin(); it != stats.constEnd(); ++it){
+        const Stats &entry = it.value();
+        double average = entry.answered ? entry.total / 1000.0 / entry.answered : 0;
+        text += QString("%1 %2 %3 %4 %5 %6\n").arg(commandName(it.key()), -18).arg(entry.count, 8)
+                .arg(entry.retransmits, 8).arg(entry.answered, 9)
+                .arg(average, 10, 'f', 3).arg(entry.max / 1000.0, 10, 'f', 3);
+    }
+
+    if(!m_frames.isEmpty()){
+        text += QString::asprintf("\nDuration: %.3f s, %d frames, %d framing errors\n",
+                                  m_frames.last().timestamp / 1e6, m_frames.size(), m_framingErrors);
+    }
+
+    if(!gaps.isEmpty()){
+        text += QString("\nIdle gaps over %1 ms:\n").arg(gapThreshold / 1000.0) + gaps;
+    }
+
+    return text;
+}
+
+} //namespace ESPFlasher
@@ -0,0 +1,109 @@
+#ifndef PROTOCOLTRACE_H
+#define PROTOCOLTRACE_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QList>
+#include <QString>
+
+namespace ESPFlasher {
+
+/*
+ * Trace file layout, all integers little endian:
+ *   "ESPTRACE", u8 version, u64 start time (ms since epoch)
+ *   records: u8 type, varint delta (us), varint size, data
+ * Sent records hold one SLIP frame as written, Received records whatever
+ * the port returned in one read, so replaying them goes through the same
+ * decoding as the live link.
+ */
+
+#define TRACE_MAGIC     "ESPTRACE"
+#define TRACE_VERSION   1
+
+struct TraceRecord
+{
+    enum Type { Sent = 0, Received = 1, Marker = 2 };
+
+    Type type;
+    qint64 timestamp;  // us since the trace started
+    QByteArray data;
+};
+
+class TraceWriter
+{
+public:
+    TraceWriter();
+
+    bool open(const QString &fileName);
+    void close();
+    bool isOpen() const { return m_file.isOpen(); }
+
+    void record(TraceRecord::Type type, const char *data, int size);
+    void mark(const QString &text);
+
+private:
+    QFile m_file;
+    QElapsedTimer m_clock;
+    qint64 m_last;
+};
+
+class TraceReader
+{
+public:
+    TraceReader();
+
+    bool open(const QString &fileName);
+    bool next(TraceRecord *record);
+
+    qint64 startTime() const { return m_startTime; }
+    QString errorString() const { return m_errorString; }
+
+private:
+    QFile m_file;
+    qint64 m_startTime;
+    qint64 m_timestamp;
+    QString m_errorString;
+};
+
+// One decoded frame of a trace
+struct TraceFrame
+{
+    enum Kind { Request, Response, Data, Marker };
+
+    Kind kind;
+    qint64 timestamp;
+    quint8 cmd;
+    QByteArray frame;
+    qint64 latency;     // us from the matching request, responses only
+    bool retransmit;    // same request as the previous one of its command
+
+    QString describe() const;
+};
+
+class TraceReplayer
+{
+public:
+    TraceReplayer();
+
+    // Feeds the trace through the SLIP decoder and pairs responses with requests
+    bool replay(const QString &fileName);
+
+    const QList<TraceFrame> &frames() const { return m_frames; }
+    int framingErrors() const { return m_framingErrors; }
+    QString errorString() const { return m_errorString; }
+
+    // Per command counts and latencies, retransmits and gaps over gapThreshold (us)
+    QString summary(qint64 gapThreshold = 100000) const;
+
+    static QString commandName(quint8 cmd);
+
+private:
+    QList<TraceFrame> m_frames;
+    int m_framingErrors;
+    QString m_errorString;
+};
+
+} //namespace ESPFlasher
+
+#endif // PROTOCOLTRACE_H
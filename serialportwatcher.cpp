@@ -0,0 +1,126 @@
+#include "serialportwatcher.h"
+
+#include <QSocketNotifier>
+#include <QTimer>
+#include <QSet>
+
+#ifdef Q_OS_LINUX
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <unistd.h>
+#include <string.h>
+#endif
+
+namespace ESPFlasher {
+
+// A plug sends a burst of uevents (usb, interface, tty): rescan once it settles
+#define EVENT_SETTLE_TIME   50
+#define POLL_INTERVAL       1000
+
+SerialPortWatcher::SerialPortWatcher(QObject *parent) :
+    QObject(parent),
+    m_socket(-1),
+    m_notifier(0),
+    m_timer(new QTimer(this))
+{
+    connect(m_timer, SIGNAL(timeout()), this, SLOT(rescan()));
+}
+
+SerialPortWatcher::~SerialPortWatcher()
+{
+#ifdef Q_OS_LINUX
+    if(m_socket >= 0){
+        ::close(m_socket);
+    }
+#endif
+}
+
+void SerialPortWatcher::start()
+{
+    if(!isEventDriven() && !openNetlink()){
+        m_timer->setSingleShot(false);
+        m_timer->start(POLL_INTERVAL);
+    }
+
+    rescan();
+}
+
+bool SerialPortWatcher::openNetlink()
+{
+#ifdef Q_OS_LINUX
+    m_socket = ::socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if(m_socket < 0){
+        return false;
+    }
+
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    // udev re-broadcasts each event once its rules ran and the vendor and
+    // product IDs are in its database; the raw kernel group (1) is too early
+    addr.nl_groups = 2;
+
+    if(::bind(m_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+        ::close(m_socket);
+        m_socket = -1;
+        return false;
+    }
+
+    m_notifier = new QSocketNotifier(m_socket, QSocketNotifier::Read, this);
+    connect(m_notifier, SIGNAL(activated(int)), this, SLOT(readEvents()));
+    m_timer->setSingleShot(true);
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+void SerialPortWatcher::readEvents()
+{
+#ifdef Q_OS_LINUX
+    char buffer[4096];
+    bool tty = false;
+
+    // Each message is a header followed by KEY=value strings
+    ssize_t size;
+    while((size = ::recv(m_socket, buffer, sizeof(buffer) - 1, 0)) > 0){
+        buffer[size] = '\0';
+        for(ssize_t i = 0; i < size; i += strlen(&buffer[i]) + 1){
+            if(strcmp(&buffer[i], "SUBSYSTEM=tty") == 0){
+                tty = true;
+                break;
+            }
+        }
+    }
+
+    if(tty){
+        m_timer->start(EVENT_SETTLE_TIME);
+    }
+#endif
+}
+
+void SerialPortWatcher::rescan()
+{
+    QSet<QString> present;
+
+    QList<QSerialPortInfo> availablePorts = QSerialPortInfo::availablePorts();
+    foreach (const QSerialPortInfo &info, availablePorts) {
+        present.insert(info.systemLocation());
+        bool added = !m_ports.contains(info.systemLocation());
+        // Keep the description and IDs of known ports current as well
+        m_ports.insert(info.systemLocation(), info);
+        if(added){
+            emit portAdded(info);
+        }
+    }
+
+    foreach (const QString &location, m_ports.keys()) {
+        if(!present.contains(location)){
+            m_ports.remove(location);
+            emit portRemoved(location);
+        }
+    }
+}
+
+} //namespace ESPFlasher
@@ -0,0 +1,50 @@
+#ifndef SERIALPORTWATCHER_H
+#define SERIALPORTWATCHER_H
+
+#include <QObject>
+#include <QMap>
+#include <QSerialPortInfo>
+
+class QSocketNotifier;
+class QTimer;
+
+namespace ESPFlasher {
+
+/*
+ * Keeps track of the serial ports present on the system and reports only
+ * the changes. On Linux it listens to udev events and rescans when a tty
+ * comes or goes; elsewhere, or without netlink access, it polls.
+ */
+class SerialPortWatcher : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SerialPortWatcher(QObject *parent = 0);
+    ~SerialPortWatcher();
+
+    // Reports the ports already present through portAdded()
+    void start();
+    bool isEventDriven() const { return m_notifier != 0; }
+    QList<QSerialPortInfo> ports() const { return m_ports.values(); }
+
+signals:
+    void portAdded(const QSerialPortInfo &info);
+    void portRemoved(const QString &systemLocation);
+
+private slots:
+    void readEvents();
+    void rescan();
+
+private:
+    bool openNetlink();
+
+private:
+    QMap<QString, QSerialPortInfo> m_ports;
+    int m_socket;
+    QSocketNotifier *m_notifier;
+    QTimer *m_timer;
+};
+
+} //namespace ESPFlasher
+
+#endif // SERIALPORTWATCHER_H
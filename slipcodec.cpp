@@ -0,0 +1,167 @@
+#include "slipcodec.h"
+
+#include <string.h>
+
+#if defined(__SSE2__) && (defined(Q_CC_GNU) || defined(Q_CC_CLANG))
+# include <emmintrin.h>
+# define HAVE_SSE2_SCAN
+#endif
+
+namespace ESPFlasher {
+
+#ifndef HAVE_SSE2_SCAN
+// Non-zero when any byte of word equals byte
+static inline quint64 hasByte(quint64 word, quint8 byte)
+{
+    word ^= Q_UINT64_C(0x0101010101010101) * byte;
+    return (word - Q_UINT64_C(0x0101010101010101)) & ~word & Q_UINT64_C(0x8080808080808080);
+}
+#endif
+
+// First SLIP_END or SLIP_ESC in [data, end), or end. Payload bytes rarely
+// need escaping, so clean runs are skipped 16 (SSE2) or 8 bytes at a time.
+static inline const char *findSpecial(const char *data, const char *end)
+{
+#ifdef HAVE_SSE2_SCAN
+    const __m128i slipEnd = _mm_set1_epi8(SLIP_END);
+    const __m128i slipEsc = _mm_set1_epi8(SLIP_ESC);
+    while(end - data >= 16){
+        __m128i chunk = _mm_loadu_si128((const __m128i *)data);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, slipEnd),
+                                                  _mm_cmpeq_epi8(chunk, slipEsc)));
+        if(mask){
+            return data + __builtin_ctz(mask);
+        }
+        data += 16;
+    }
+#else
+    while(end - data >= 8){
+        quint64 word;
+        memcpy(&word, data, 8);
+        if(hasByte(word, 0xc0) | hasByte(word, 0xdb)){
+            break;
+        }
+        data += 8;
+    }
+#endif
+    while(data < end && *data != SLIP_END && *data != SLIP_ESC){
+        data++;
+    }
+    return data;
+}
+
+SlipEncoder::SlipEncoder(int capacity):
+    m_buffer(capacity, SLIP_END),
+    m_size(0)
+{
+}
+
+void SlipEncoder::reserve(int size)
+{
+    if(m_size + size > m_buffer.size()){
+        m_buffer.resize(qMax(m_size + size, 2 * m_buffer.size()));
+    }
+}
+
+void SlipEncoder::begin()
+{
+    m_size = 0;
+    reserve(1);
+    m_buffer.data()[m_size++] = SLIP_END;
+}
+
+void SlipEncoder::append(const char *data, int size)
+{
+    // Worst case every byte is escaped
+    reserve(2 * size);
+
+    char *out = m_buffer.data() + m_size;
+    const char *end = data + size;
+    while(data < end){
+        const char *special = findSpecial(data, end);
+        memcpy(out, data, special - data);
+        out += special - data;
+        if(special == end){
+            break;
+        }
+        *out++ = SLIP_ESC;
+        *out++ = *special == SLIP_END ? SLIP_ESC_END : SLIP_ESC_ESC;
+        data = special + 1;
+    }
+    m_size = out - m_buffer.data();
+}
+
+void SlipEncoder::end()
+{
+    reserve(1);
+    m_buffer.data()[m_size++] = SLIP_END;
+}
+
+SlipDecoder::SlipDecoder():
+    m_inFrame(false),
+    m_escape(false),
+    m_errors(0)
+{
+}
+
+void SlipDecoder::reset()
+{
+    m_frames.clear();
+    m_frame.clear();
+    m_inFrame = false;
+    m_escape = false;
+}
+
+void SlipDecoder::feed(const char *data, int size)
+{
+    const char *end = data + size;
+
+    while(data < end)
+    {
+        if(!m_inFrame){
+            // Anything outside of a frame (boot messages, noise) is dropped
+            data = (const char *)memchr(data, SLIP_END, end - data);
+            if(!data)
+                break;
+
+            data++;
+            m_inFrame = true;
+            continue;
+        }
+
+        if(m_escape){
+            m_escape = false;
+            if(*data == SLIP_ESC_END){
+                m_frame.append(SLIP_END);
+            } else if(*data == SLIP_ESC_ESC){
+                m_frame.append(SLIP_ESC);
+            } else {
+                m_errors++;
+                m_frame.clear();
+                m_inFrame = false;
+            }
+            data++;
+            continue;
+        }
+
+        // Copy the run of plain bytes in one go
+        const char *run = data;
+        data = findSpecial(data, end);
+        if(data > run)
+            m_frame.append(run, data - run);
+        if(data == end)
+            break;
+
+        if(*data == SLIP_ESC){
+            m_escape = true;
+        } else if(!m_frame.isEmpty()){
+            m_frames.enqueue(m_frame);
+            m_frame.clear();
+            m_inFrame = false;
+        }
+        // An empty frame (two delimiters in a row) opens the next one
+        data++;
+    }
+}
+
+} //namespace ESPFlasher
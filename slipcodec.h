@@ -0,0 +1,65 @@
+#ifndef SLIPCODEC_H
+#define SLIPCODEC_H
+
+#include <QByteArray>
+#include <QQueue>
+
+namespace ESPFlasher {
+
+#define SLIP_END        '\xc0'
+#define SLIP_ESC        '\xdb'
+#define SLIP_ESC_END    '\xdc'
+#define SLIP_ESC_ESC    '\xdd'
+
+// Single pass SLIP encoder writing into a reusable transmit buffer: once the
+// buffer has grown to the largest frame, encoding does not allocate anymore.
+class SlipEncoder
+{
+public:
+    explicit SlipEncoder(int capacity = 0);
+
+    void begin();
+    void append(const char *data, int size);
+    void end();
+
+    const char *constData() const { return m_buffer.constData(); }
+    int size() const { return m_size; }
+
+private:
+    void reserve(int size);
+
+private:
+    QByteArray m_buffer;
+    int m_size;
+};
+
+// Incremental SLIP decoder: fed with whatever the serial port returns, it
+// unescapes whole runs at once and queues every complete frame.
+class SlipDecoder
+{
+public:
+    SlipDecoder();
+
+    void feed(const char *data, int size);
+    void feed(const QByteArray &data) { feed(data.constData(), data.size()); }
+
+    bool hasFrame() const { return !m_frames.isEmpty(); }
+    QByteArray takeFrame() { return m_frames.dequeue(); }
+
+    // Bytes of a frame currently being received
+    int pending() const { return m_frame.size(); }
+    int errors() const { return m_errors; }
+
+    void reset();
+
+private:
+    QQueue<QByteArray> m_frames;
+    QByteArray m_frame;
+    bool m_inFrame;
+    bool m_escape;
+    int m_errors;
+};
+
+} //namespace ESPFlasher
+
+#endif // SLIPCODEC_H
@@ -5,6 +5,13 @@
 #include <QStringList>
 #include <QDir>
 
+#include <string.h>
+
+#if (defined(Q_CC_GNU) || defined(Q_CC_CLANG)) && (defined(Q_PROCESSOR_X86_64) || defined(Q_PROCESSOR_X86_32))
+# include <immintrin.h>
+# define HAVE_X86_CHECKSUM
+#endif
+
 namespace ESPFlasher {
 
 
@@ -13,6 +20,110 @@ Tools::Tools()
 
 }
 
+typedef quint8 (*ChecksumFunction)(const char *data, int size, quint8 state);
+
+static inline quint8 foldChecksum(quint64 word, quint8 state)
+{
+    word ^= word >> 32;
+    word ^= word >> 16;
+    word ^= word >> 8;
+    return state ^ quint8(word);
+}
+
+static quint8 checksumPortable(const char *data, int size, quint8 state)
+{
+    // Eight bytes per XOR, the byte lanes are folded together at the end
+    quint64 word = 0;
+    int i = 0;
+    for(; i + 8 <= size; i += 8){
+        quint64 chunk;
+        memcpy(&chunk, data + i, 8);
+        word ^= chunk;
+    }
+    for(; i < size; i++){
+        state ^= data[i];
+    }
+    return foldChecksum(word, state);
+}
+
+#ifdef HAVE_X86_CHECKSUM
+__attribute__((target("sse2")))
+static quint8 checksumSSE2(const char *data, int size, quint8 state)
+{
+    // Four independent accumulators keep the loads from waiting on each other
+    __m128i a = _mm_setzero_si128(), b = a, c = a, d = a;
+    int i = 0;
+    for(; i + 64 <= size; i += 64){
+        a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i *)(data + i)));
+        b = _mm_xor_si128(b, _mm_loadu_si128((const __m128i *)(data + i + 16)));
+        c = _mm_xor_si128(c, _mm_loadu_si128((const __m128i *)(data + i + 32)));
+        d = _mm_xor_si128(d, _mm_loadu_si128((const __m128i *)(data + i + 48)));
+    }
+    for(; i + 16 <= size; i += 16){
+        a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i *)(data + i)));
+    }
+    a = _mm_xor_si128(_mm_xor_si128(a, b), _mm_xor_si128(c, d));
+    a = _mm_xor_si128(a, _mm_srli_si128(a, 8));
+
+    quint64 word;
+    _mm_storel_epi64((__m128i *)&word, a);
+    return checksumPortable(data + i, size - i, foldChecksum(word, state));
+}
+
+__attribute__((target("avx2")))
+static quint8 checksumAVX2(const char *data, int size, quint8 state)
+{
+    __m256i a = _mm256_setzero_si256(), b = a, c = a, d = a;
+    int i = 0;
+    for(; i + 128 <= size; i += 128){
+        a = _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i *)(data + i)));
+        b = _mm256_xor_si256(b, _mm256_loadu_si256((const __m256i *)(data + i + 32)));
+        c = _mm256_xor_si256(c, _mm256_loadu_si256((const __m256i *)(data + i + 64)));
+        d = _mm256_xor_si256(d, _mm256_loadu_si256((const __m256i *)(data + i + 96)));
+    }
+    a = _mm256_xor_si256(_mm256_xor_si256(a, b), _mm256_xor_si256(c, d));
+
+    __m128i x = _mm_xor_si128(_mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1));
+    x = _mm_xor_si128(x, _mm_srli_si128(x, 8));
+
+    quint64 word;
+    _mm_storel_epi64((__m128i *)&word, x);
+    return checksumSSE2(data + i, size - i, foldChecksum(word, state));
+}
+#endif
+
+static ChecksumFunction resolveChecksum(const char **name)
+{
+#ifdef HAVE_X86_CHECKSUM
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        *name = "avx2";
+        return checksumAVX2;
+    }
+    if(__builtin_cpu_supports("sse2")){
+        *name = "sse2";
+        return checksumSSE2;
+    }
+#endif
+    *name = "portable";
+    return checksumPortable;
+}
+
+quint8 Tools::checksum(const char *data, int size, quint8 state)
+{
+    // Resolved on first use, safe against static initialization order
+    static const char *name;
+    static const ChecksumFunction function = resolveChecksum(&name);
+    return function(data, size, state);
+}
+
+const char *Tools::checksumImplementation()
+{
+    const char *name;
+    resolveChecksum(&name);
+    return name;
+}
+
 // Open Folder & select torrent's file or top folder
 #undef HAVE_OPEN_SELECT
 #if defined (Q_OS_WIN)
@@ -11,6 +11,9 @@ namespace ESPFlasher {
 #define ESP_RAM_BLOCK       0x1800
 #define ESP_FLASH_BLOCK     0x400
 
+// Smallest erasable unit of the SPI flash
+#define ESP_FLASH_SECTOR    0x1000
+
 // Default baudrate. The ROM auto-bauds, so we can use more or less whatever we want.
 #define ESP_ROM_BAUD        115200
 
@@ -82,12 +85,13 @@ public:
     static bool isMacHost() { return hostOs() == OsTypeMac; }
 
 
+    // XOR of all bytes, vectorized with AVX2 or SSE2 when the CPU has them
+    static quint8 checksum(const char *data, int size, quint8 state = ESP_CHECKSUM_MAGIC);
     static quint8 checksum(const QByteArray &data, quint8 state = ESP_CHECKSUM_MAGIC)
     {
-        for(int i = 0; i < data.size(); i++)
-            state ^= data.at(i);
-        return state;
+        return checksum(data.constData(), data.size(), state);
     }
+    static const char *checksumImplementation();
 
     static quint32 divRoundup(quint32 a, quint32 b)
     {
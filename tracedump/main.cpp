@@ -0,0 +1,59 @@
+#include "protocoltrace.h"
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QTextStream>
+
+using namespace ESPFlasher;
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    a.setApplicationName("esptracedump");
+    a.setApplicationVersion("0.1");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Decodes a protocol trace recorded by ESPFlasher.");
+    parser.addHelpOption();
+    parser.addVersionOption();
+
+    QCommandLineOption summaryOption(QStringList() << "s" << "summary", "Only print the summary.");
+    QCommandLineOption gapOption(QStringList() << "g" << "gap", "Report idle gaps longer than this.", "ms", "100");
+
+    parser.addOption(summaryOption);
+    parser.addOption(gapOption);
+    parser.addPositionalArgument("trace", "Trace file (.esptrace).");
+
+    parser.process(a);
+
+    if(parser.positionalArguments().size() != 1){
+        parser.showHelp(1);
+    }
+
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+
+    TraceReplayer replayer;
+    if(!replayer.replay(parser.positionalArguments().first())){
+        err << replayer.errorString() << "\n";
+        return 1;
+    }
+
+    if(!parser.isSet(summaryOption)){
+        foreach(const TraceFrame &frame, replayer.frames()){
+            out << QString::asprintf("%12.6f ", frame.timestamp / 1e6) << frame.describe() << "\n";
+        }
+        out << "\n";
+    }
+
+    out << replayer.summary(qint64(parser.value(gapOption).toDouble() * 1000));
+
+    out.flush();
+
+    // Kept going on a truncated capture, but say so
+    if(!replayer.errorString().isEmpty()){
+        err << replayer.errorString() << "\n";
+    }
+
+    return 0;
+}
@@ -0,0 +1,24 @@
+#-------------------------------------------------
+#
+# Offline decoder for ESPFlasher protocol traces
+#
+#-------------------------------------------------
+
+QT       += core
+QT       -= gui
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+TARGET = esptracedump
+TEMPLATE = app
+
+INCLUDEPATH += ..
+
+SOURCES += main.cpp \
+    ../protocoltrace.cpp \
+    ../slipcodec.cpp
+
+HEADERS  += ../protocoltrace.h \
+    ../slipcodec.h \
+    ../tools.h